@@ -0,0 +1,101 @@
+/* Checks that modifications of a set allocate nothing but the nodes they create: paths to the modified place are kept
+ * on the stack, so no container should be allocated on the way. Every call of global operator new is counted.
+ * Build and run: g++ -std=c++17 alloc_test.cpp -o alloc_test && ./alloc_test
+ */
+#include <assert.h>
+#include <cstdio>
+#include <cstdlib>
+#include <new>
+
+static size_t allocations = 0;
+
+void* operator new(std::size_t size) {
+    ++allocations;
+    if (void* memory = std::malloc(size == 0 ? 1 : size)) {
+        return memory;
+    }
+    throw std::bad_alloc();
+}
+
+void operator delete(void* memory) noexcept {
+    std::free(memory);
+}
+
+void operator delete(void* memory, std::size_t) noexcept {
+    std::free(memory);
+}
+
+#define main set_main
+#include "set.cpp"
+#undef main
+
+constexpr int ELEMENTS = 1000;
+// Multiplier coprime with ELEMENTS, so that elements are inserted in scattered order.
+constexpr int STEP = 7919;
+
+// Number of allocations made by the operation.
+template<class Operation>
+size_t count_allocations(Operation operation) {
+    size_t before = allocations;
+    operation();
+    return allocations - before;
+}
+
+template<class SetType>
+void check_allocations(const char* name) {
+    SetType st;
+    size_t created = count_allocations([&] {
+        for (int i = 0; i < ELEMENTS; ++i) {
+            st.insert(i * STEP % ELEMENTS);
+        }
+    });
+    assert(created == ELEMENTS);
+
+    size_t duplicates = count_allocations([&] {
+        for (int i = 0; i < ELEMENTS; ++i) {
+            st.insert(i);
+            st.insert(st.end(), i);
+        }
+    });
+    assert(duplicates == 0);
+
+    size_t erased = count_allocations([&] {
+        for (int i = 0; i < ELEMENTS; i += 2) {
+            st.erase(i * STEP % ELEMENTS);
+        }
+    });
+    assert(erased == 0);
+
+    size_t hinted = count_allocations([&] {
+        for (int i = 0; i < ELEMENTS; i += 2) {
+            st.insert(st.find(i + 1), i);
+        }
+    });
+    assert(hinted == ELEMENTS / 2);
+
+    size_t erased_by_iterator = count_allocations([&] {
+        for (auto it = st.begin(); it != st.end();) {
+            it = st.erase(it);
+        }
+    });
+    assert(erased_by_iterator == 0 && st.empty());
+
+    for (int i = 0; i < ELEMENTS; ++i) {
+        st.insert(i);
+    }
+    size_t moved_nodes = count_allocations([&] {
+        for (int i = 0; i < ELEMENTS; ++i) {
+            auto handle = st.extract(i * STEP % ELEMENTS);
+            st.insert(std::move(handle));
+        }
+    });
+    assert(moved_nodes == 0 && st.size() == ELEMENTS);
+
+    printf("%s: no allocations besides new nodes\n", name);
+}
+
+int main() {
+    check_allocations<Set<int>>("Set");
+    check_allocations<Set<int, std::less<int>, std::allocator<int>, false>>("Set without parent links");
+    return 0;
+}
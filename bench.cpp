@@ -0,0 +1,315 @@
+/* Benchmarks behind the numbers quoted in the history of set.cpp. Each section prints its own lines; pass section names
+ * to run only some of them: alloc, compact, insert, hint, three-way, batch.
+ * Build and run: g++ -std=c++20 -O2 bench.cpp -o bench && ./bench
+ * The three-way section compares string comparisons with a C++17 build of the same file.
+ */
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <random>
+#include <string>
+#include <vector>
+
+#define main set_main
+#include "set.cpp"
+#undef main
+
+using Clock = std::chrono::steady_clock;
+
+static size_t comparisons = 0;
+
+double nanoseconds_per(Clock::time_point start, Clock::time_point finish, size_t operations) {
+    return std::chrono::duration<double, std::nano>(finish - start).count() / operations;
+}
+
+double milliseconds(Clock::time_point start, Clock::time_point finish) {
+    return std::chrono::duration<double, std::milli>(finish - start).count();
+}
+
+// Compare calling operator< and counting the calls, which also keeps compare_values off the operator<=> path.
+template<class T>
+struct CountingLess {
+    bool operator()(const T& a, const T& b) const {
+        ++comparisons;
+        return a < b;
+    }
+};
+
+// Character traits counting string comparisons, so that both operator< and operator<=> of the string are counted.
+struct CountingTraits : std::char_traits<char> {
+    static int compare(const char* a, const char* b, size_t count) {
+        ++comparisons;
+        return std::char_traits<char>::compare(a, b, count);
+    }
+};
+
+using CountingString = std::basic_string<char, CountingTraits>;
+
+// Block of the size of a Set<int> node with parent links.
+struct NodeSized {
+    void* links[3];
+    int64_t value;
+};
+
+constexpr size_t ALLOC_BLOCKS = 1 << 20;
+constexpr int ALLOC_ROUNDS = 4;
+
+template<class Allocator>
+double allocate_and_free(Allocator allocator, const std::vector<size_t>& order) {
+    std::vector<NodeSized*> blocks(ALLOC_BLOCKS);
+    auto start = Clock::now();
+    for (NodeSized*& block : blocks) {
+        block = allocator.allocate(1);
+    }
+    for (int round = 0; round < ALLOC_ROUNDS; ++round) {
+        for (size_t index : order) {
+            allocator.deallocate(blocks[index], 1);
+            blocks[index] = allocator.allocate(1);
+        }
+    }
+    for (size_t index : order) {
+        allocator.deallocate(blocks[index], 1);
+    }
+    return nanoseconds_per(start, Clock::now(), ALLOC_BLOCKS * (ALLOC_ROUNDS + 1));
+}
+
+// Allocation of node-sized blocks, each freed in random order and replaced by a new one.
+void bench_alloc() {
+    std::vector<size_t> order(ALLOC_BLOCKS);
+    for (size_t i = 0; i < ALLOC_BLOCKS; ++i) {
+        order[i] = i;
+    }
+    std::shuffle(order.begin(), order.end(), std::mt19937_64(0));
+    double system = allocate_and_free(std::allocator<NodeSized>(), order);
+    double pooled = allocate_and_free(NodePoolAllocator<NodeSized>(), order);
+    printf("alloc: %zu live blocks of %zu bytes replaced in random order, per allocate+deallocate\n", ALLOC_BLOCKS,
+           sizeof(NodeSized));
+    printf("  std::allocator     %.1f ns\n", system);
+    printf("  NodePoolAllocator  %.1f ns\n", pooled);
+}
+
+constexpr size_t COMPACT_KEYS = 1 << 21;
+constexpr size_t COMPACT_CHURN = 1 << 22;
+constexpr size_t COMPACT_LOOKUPS = 1 << 21;
+
+double find_time(const Set<uint64_t>& st, const std::vector<uint64_t>& keys) {
+    std::mt19937_64 rng(2);
+    size_t found = 0;
+    auto start = Clock::now();
+    for (size_t i = 0; i < COMPACT_LOOKUPS; ++i) {
+        found += (st.find(keys[rng() % keys.size()]) != st.end());
+    }
+    auto finish = Clock::now();
+    if (found != COMPACT_LOOKUPS) {
+        printf("  lookup missed a key\n");
+    }
+    return nanoseconds_per(start, finish, COMPACT_LOOKUPS);
+}
+
+// Lookups in a set whose nodes were scattered by churn, before and after compact().
+void bench_compact() {
+    std::mt19937_64 rng(1);
+    std::vector<uint64_t> keys(COMPACT_KEYS);
+    Set<uint64_t> st;
+    for (uint64_t& key : keys) {
+        key = rng();
+        st.insert(key);
+    }
+    for (size_t i = 0; i < COMPACT_CHURN; ++i) {
+        uint64_t& key = keys[rng() % keys.size()];
+        st.erase(key);
+        key = rng();
+        st.insert(key);
+    }
+    double before = find_time(st, keys);
+    auto start = Clock::now();
+    st.compact();
+    auto finish = Clock::now();
+    double after = find_time(st, keys);
+    printf("compact: Set<uint64_t> with %zu keys after %zu erase+insert steps\n", COMPACT_KEYS, COMPACT_CHURN);
+    printf("  find() before compact  %.0f ns\n", before);
+    printf("  find() after compact   %.0f ns\n", after);
+    printf("  compact() itself       %.0f ms\n", milliseconds(start, finish));
+}
+
+constexpr size_t INSERT_KEYS = 200000;
+
+// Comparisons made by insert of new and duplicate string keys, against the two descents of contains and insert.
+void bench_insert() {
+    std::vector<std::string> keys;
+    for (size_t i = 0; i < INSERT_KEYS; ++i) {
+        std::string number = std::to_string(i * 7919 % INSERT_KEYS);
+        keys.push_back(std::string(30 - number.size(), 'k') + number);
+    }
+    Set<std::string, CountingLess<std::string>> single;
+    Set<std::string, CountingLess<std::string>> twice;
+    auto start = Clock::now();
+    comparisons = 0;
+    for (const std::string& key : keys) {
+        single.insert(key);
+    }
+    size_t fresh = comparisons;
+    comparisons = 0;
+    for (const std::string& key : keys) {
+        single.insert(key);
+    }
+    size_t duplicate = comparisons;
+    auto finish = Clock::now();
+    comparisons = 0;
+    for (const std::string& key : keys) {
+        if (!twice.contains(key)) {
+            twice.insert(key);
+        }
+    }
+    size_t fresh_twice = comparisons;
+    comparisons = 0;
+    for (const std::string& key : keys) {
+        if (!twice.contains(key)) {
+            twice.insert(key);
+        }
+    }
+    size_t duplicate_twice = comparisons;
+    printf("insert: %zu keys of 30 characters, comparisons per new key / per duplicate\n", INSERT_KEYS);
+    printf("  contains, then insert  %.1f / %.1f\n", double(fresh_twice) / INSERT_KEYS,
+           double(duplicate_twice) / INSERT_KEYS);
+    printf("  insert                 %.1f / %.1f, %.0f ms total\n", double(fresh) / INSERT_KEYS,
+           double(duplicate) / INSERT_KEYS, milliseconds(start, finish));
+}
+
+constexpr size_t HINT_KEYS = 1000000;
+
+template<bool ParentLinks>
+void hinted_ingest(const char* name) {
+    using CountingSet = Set<int64_t, CountingLess<int64_t>, std::allocator<int64_t>, ParentLinks>;
+    using PlainSet = Set<int64_t, std::less<int64_t>, std::allocator<int64_t>, ParentLinks>;
+    CountingSet counted;
+    CountingSet counted_hinted;
+    comparisons = 0;
+    for (size_t i = 0; i < HINT_KEYS; ++i) {
+        counted.insert(int64_t(i));
+    }
+    size_t plain_comparisons = comparisons;
+    comparisons = 0;
+    for (size_t i = 0; i < HINT_KEYS; ++i) {
+        counted_hinted.insert(counted_hinted.end(), int64_t(i));
+    }
+    size_t hinted_comparisons = comparisons;
+
+    PlainSet plain;
+    PlainSet hinted;
+    auto start = Clock::now();
+    for (size_t i = 0; i < HINT_KEYS; ++i) {
+        plain.insert(int64_t(i));
+    }
+    auto middle = Clock::now();
+    for (size_t i = 0; i < HINT_KEYS; ++i) {
+        hinted.insert(hinted.end(), int64_t(i));
+    }
+    auto finish = Clock::now();
+    printf("  %s:\n", name);
+    printf("    insert(x)           %4.1f comparisons, %3.0f ns per element\n",
+           double(plain_comparisons) / HINT_KEYS, nanoseconds_per(start, middle, HINT_KEYS));
+    printf("    insert(end(), x)    %4.1f comparisons, %3.0f ns per element\n",
+           double(hinted_comparisons) / HINT_KEYS, nanoseconds_per(middle, finish, HINT_KEYS));
+}
+
+// Ingest of sorted keys with and without the end() hint.
+void bench_hint() {
+    printf("hint: inserting %zu sorted keys\n", HINT_KEYS);
+    hinted_ingest<true>("with parent links");
+    hinted_ingest<false>("without parent links");
+}
+
+constexpr size_t THREE_WAY_KEYS = 1 << 18;
+
+// String comparisons per successful lookup of keys sharing a long prefix, operator<=> is used only in C++20 builds.
+void bench_three_way() {
+    std::vector<CountingString> keys;
+    for (size_t i = 0; i < THREE_WAY_KEYS; ++i) {
+        std::string number = std::to_string(uint32_t(i * 2654435761u) % 100000000u);
+        keys.push_back(CountingString("/var/log/service/instance-") + CountingString(number.data(), number.size()));
+    }
+    Set<CountingString> st;
+    for (const CountingString& key : keys) {
+        st.insert(key);
+    }
+    size_t found = 0;
+    comparisons = 0;
+    auto start = Clock::now();
+    for (const CountingString& key : keys) {
+        found += st.contains(key);
+    }
+    auto finish = Clock::now();
+    printf("three-way: C++%ld, %zu keys with a 26-character common prefix\n", __cplusplus / 100 % 100, found);
+    printf("  %.1f comparisons, %.0f ns per successful contains\n", double(comparisons) / THREE_WAY_KEYS,
+           nanoseconds_per(start, finish, THREE_WAY_KEYS));
+}
+
+constexpr size_t BATCH_SET_SIZE = 1000000;
+constexpr int BATCH_REPEATS = 3;
+
+// Merging a batch of random keys into a copy of the set, key by key and with insert_batch.
+void bench_batch() {
+    std::mt19937_64 rng(1);
+    std::vector<int64_t> elements(BATCH_SET_SIZE);
+    for (int64_t& elem : elements) {
+        elem = int64_t(rng() % (4 * BATCH_SET_SIZE));
+    }
+    Set<int64_t> base(elements.begin(), elements.end());
+    printf("batch: random keys merged into a copy of a set of %zu\n", BATCH_SET_SIZE);
+    for (size_t batch_size = 1000; batch_size <= BATCH_SET_SIZE; batch_size *= 10) {
+        std::vector<int64_t> batch(batch_size);
+        for (int64_t& elem : batch) {
+            elem = int64_t(rng() % (4 * BATCH_SET_SIZE));
+        }
+        double one_by_one = 0;
+        double batched = 0;
+        for (int repeat = 0; repeat < BATCH_REPEATS; ++repeat) {
+            Set<int64_t> first = base;
+            Set<int64_t> second = base;
+            auto start = Clock::now();
+            for (int64_t elem : batch) {
+                first.insert(elem);
+            }
+            auto middle = Clock::now();
+            second.insert_batch(batch.begin(), batch.end());
+            auto finish = Clock::now();
+            if (first.size() != second.size()) {
+                printf("  sizes differ\n");
+            }
+            one_by_one += milliseconds(start, middle);
+            batched += milliseconds(middle, finish);
+        }
+        printf("  m=%-8zu insert %8.2f ms   insert_batch %8.2f ms\n", batch_size, one_by_one / BATCH_REPEATS,
+               batched / BATCH_REPEATS);
+    }
+}
+
+struct Benchmark {
+    const char* name;
+    void (*run)();
+};
+
+int main(int argc, char* argv[]) {
+    setvbuf(stdout, nullptr, _IONBF, 0);
+    const Benchmark benchmarks[] = {
+        {"alloc", bench_alloc},
+        {"compact", bench_compact},
+        {"insert", bench_insert},
+        {"hint", bench_hint},
+        {"three-way", bench_three_way},
+        {"batch", bench_batch},
+    };
+    for (const Benchmark& benchmark : benchmarks) {
+        bool selected = (argc == 1);
+        for (int i = 1; i < argc; ++i) {
+            selected = selected || std::strcmp(argv[i], benchmark.name) == 0;
+        }
+        if (selected) {
+            benchmark.run();
+        }
+    }
+    return 0;
+}
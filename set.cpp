@@ -1,93 +1,446 @@
 #include <algorithm>
 #include <assert.h>
+#if __has_include(<compare>)
+#include <compare>
+#endif
 #include <cstddef>
+#include <cstdint>
 #include <iostream>
+#include <iterator>
+#include <limits>
+#include <memory>
+#include <memory_resource>
+#include <new>
+#include <optional>
 #include <stack>
+#include <stdexcept>
+#include <string>
+#include <string_view>
+#include <type_traits>
+#include <utility>
+#include <vector>
+
+/* Counters of rebalancing work done by modifications of a set, kept by sets only if AVL_SET_STATS is defined.
+ * Comparing them with the number of modifications shows the amortized cost of retracing.
+ */
+struct RebalanceStats {
+    // Nodes whose balance was updated on the way up from a modified place.
+    size_t visited_nodes = 0;
+    // Single rotations, double rotation counts as two.
+    size_t rotations = 0;
+};
+
+/* Memory pool handing out fixed-size blocks carved from large chunks, one chain of chunks per block size.
+ * Freed blocks are kept in an intrusive singly linked list and reused before carving new ones.
+ * Chunks grow geometrically and are returned to the system only when the pool is destroyed.
+ */
+class NodePool {
+  public:
+    NodePool() = default;
+
+    NodePool(const NodePool&) = delete;
+
+    NodePool& operator=(const NodePool&) = delete;
+
+    ~NodePool() {
+        for (void* chunk : chunks_) {
+            ::operator delete(chunk);
+        }
+    }
+
+    // Returns block of at least given size aligned for any fundamental type, amortized time O(1).
+    void* allocate(size_t size) {
+        SizeClass& size_class = find_size_class(size);
+        if (size_class.free_list != nullptr) {
+            FreeBlock* block = size_class.free_list;
+            size_class.free_list = block->next;
+            return block;
+        }
+        if (size_class.chunk_pos == size_class.chunk_end) {
+            add_chunk(size_class);
+        }
+        void* block = size_class.chunk_pos;
+        size_class.chunk_pos += size_class.block_size;
+        return block;
+    }
+
+    // Puts block back to the free list of its size, constant time.
+    void deallocate(void* block, size_t size) {
+        SizeClass& size_class = find_size_class(size);
+        FreeBlock* freed = static_cast<FreeBlock*>(block);
+        freed->next = size_class.free_list;
+        size_class.free_list = freed;
+    }
+
+  private:
+    // Amount of blocks in the first chunk of each size, every next chunk is twice larger up to the maximum.
+    constexpr static size_t FIRST_CHUNK_BLOCKS = 16;
+    constexpr static size_t MAX_CHUNK_BLOCKS = 4096;
+
+    // Freed block reuses its own memory to store the link to the next free block.
+    struct FreeBlock {
+        FreeBlock *next = nullptr;
+    };
+
+    struct SizeClass {
+        size_t block_size = 0;
+        size_t chunk_blocks = FIRST_CHUNK_BLOCKS;
+        FreeBlock *free_list = nullptr;
+        char *chunk_pos = nullptr;
+        char *chunk_end = nullptr;
+    };
+
+    // Containers allocate nodes of one or two sizes, so linear search is faster than any map.
+    std::vector<SizeClass> size_classes_;
+    std::vector<void*> chunks_;
+
+    SizeClass& find_size_class(size_t size) {
+        constexpr size_t granularity = alignof(std::max_align_t);
+        size_t block_size = std::max(size, sizeof(FreeBlock));
+        block_size = (block_size + granularity - 1) / granularity * granularity;
+        for (SizeClass& size_class : size_classes_) {
+            if (size_class.block_size == block_size) {
+                return size_class;
+            }
+        }
+        size_classes_.emplace_back();
+        size_classes_.back().block_size = block_size;
+        return size_classes_.back();
+    }
+
+    void add_chunk(SizeClass& size_class) {
+        chunks_.reserve(chunks_.size() + 1);
+        char* chunk = static_cast<char*>(::operator new(size_class.block_size * size_class.chunk_blocks));
+        chunks_.push_back(chunk);
+        size_class.chunk_pos = chunk;
+        size_class.chunk_end = chunk + size_class.block_size * size_class.chunk_blocks;
+        size_class.chunk_blocks = std::min(size_class.chunk_blocks * 2, MAX_CHUNK_BLOCKS);
+    }
+};
+
+/* Allocator compatible with std::allocator serving single objects from a NodePool, so that node-based containers
+ * do not call global allocator on each insertion. All copies and rebound copies share the same pool.
+ * Arrays and over-aligned types are passed to std::allocator.
+ */
+template<class T>
+class NodePoolAllocator {
+  public:
+    using value_type = T;
+    using propagate_on_container_copy_assignment = std::false_type;
+    using propagate_on_container_move_assignment = std::true_type;
+    using propagate_on_container_swap = std::true_type;
+    using is_always_equal = std::false_type;
+
+    NodePoolAllocator() : pool_(std::make_shared<NodePool>()) {}
+
+    // Moving allocator must leave the source usable, so copy is used for both.
+    NodePoolAllocator(const NodePoolAllocator&) noexcept = default;
+
+    template<class U>
+    NodePoolAllocator(const NodePoolAllocator<U>& other) noexcept : pool_(other.pool_) {}
+
+    NodePoolAllocator& operator=(const NodePoolAllocator&) noexcept = default;
+
+    T* allocate(size_t n) {
+        if (n != 1 || alignof(T) > alignof(std::max_align_t)) {
+            return std::allocator<T>().allocate(n);
+        }
+        return static_cast<T*>(pool_->allocate(sizeof(T)));
+    }
+
+    void deallocate(T* ptr, size_t n) {
+        if (n != 1 || alignof(T) > alignof(std::max_align_t)) {
+            std::allocator<T>().deallocate(ptr, n);
+            return;
+        }
+        pool_->deallocate(ptr, sizeof(T));
+    }
+
+    // Copy of a container gets its own pool instead of sharing one with the original.
+    NodePoolAllocator select_on_container_copy_construction() const {
+        return NodePoolAllocator();
+    }
+
+    template<class U>
+    bool operator==(const NodePoolAllocator<U>& other) const {
+        return pool_ == other.pool_;
+    }
+
+    template<class U>
+    bool operator!=(const NodePoolAllocator<U>& other) const {
+        return pool_ != other.pool_;
+    }
+
+  private:
+    template<class U>
+    friend class NodePoolAllocator;
+
+    std::shared_ptr<NodePool> pool_;
+};
+
+/* Holds comparator of a container. Comparator without state is kept as an empty base class and takes no space,
+ * final classes can't be derived from and are kept as a member.
+ */
+template<class Compare, bool EmptyBase = std::is_empty<Compare>::value && !std::is_final<Compare>::value>
+class ComparatorStorage : private Compare {
+  public:
+    ComparatorStorage() = default;
+
+    explicit ComparatorStorage(const Compare& comp) : Compare(comp) {}
+
+    const Compare& comparator() const {
+        return *this;
+    }
+
+    Compare& comparator() {
+        return *this;
+    }
+};
+
+template<class Compare>
+class ComparatorStorage<Compare, false> {
+  public:
+    ComparatorStorage() = default;
+
+    explicit ComparatorStorage(const Compare& comp) : comp_(comp) {}
+
+    const Compare& comparator() const {
+        return comp_;
+    }
+
+    Compare& comparator() {
+        return comp_;
+    }
+
+  private:
+    Compare comp_ = Compare();
+};
+
+/* Types whose operator<=> is known to order values the same way as operator<. A user type may define the two
+ * differently, so its operator<=> is never used in place of the comparator.
+ */
+template<class T>
+struct has_consistent_three_way : std::is_arithmetic<T> {};
+
+template<class Char, class Traits, class Alloc>
+struct has_consistent_three_way<std::basic_string<Char, Traits, Alloc>> : std::true_type {};
+
+template<class Char, class Traits>
+struct has_consistent_three_way<std::basic_string_view<Char, Traits>> : std::true_type {};
+
+/* Three-way comparison of values: negative if a goes before b, zero if they are equivalent, positive otherwise.
+ * For default ordering of strings and arithmetic types this costs one comparison with operator<=>, which matters for
+ * keys with long common prefixes. Otherwise the comparator is called twice unless the first call finds a to be less.
+ */
+template<class T, class Compare>
+int32_t compare_values(const Compare& comp, const T& a, const T& b) {
+#if defined(__cpp_impl_three_way_comparison) && defined(__cpp_lib_three_way_comparison)
+    if constexpr ((std::is_same<Compare, std::less<T>>::value || std::is_same<Compare, std::less<>>::value) &&
+                  has_consistent_three_way<T>::value) {
+        auto order = a <=> b;
+        return (order < 0 ? -1 : (order > 0 ? 1 : 0));
+    }
+#endif
+    if (comp(a, b)) {
+        return -1;
+    }
+    return (comp(b, a) ? 1 : 0);
+}
+
+// Tag telling a set constructor that the input is sorted by the set's comparator and has no equivalent elements.
+struct sorted_unique_t {
+    explicit sorted_unique_t() = default;
+};
+
+inline constexpr sorted_unique_t sorted_unique{};
+
+template<class T, size_t N, class Compare, class Allocator>
+class SmallSet;
 
 /* Class for balanced binary search tree based on AVL tree.
  * Balanced depth is achieved through keeping difference between heights of left and right children less than 2.
  * Allows inserting/extracting elements with logarithmic complexity, linear memory usage.
+ * Elements are ordered by Compare, which is std::less by default.
+ * With ParentLinks disabled nodes do not store links to their parents, saving a pointer per node, and iterators keep
+ * the path from the root instead: they become larger, begin() takes logarithmic time and any modification of the set
+ * invalidates all iterators.
  */
-template<class T>
-class Set {
+template<class T, class Compare = std::less<T>, class Allocator = std::allocator<T>, bool ParentLinks = true>
+class Set : private ComparatorStorage<Compare> {
   private:
-    // Element in AVL tree storing actual value and three connected elements.
-    struct TNode {
+    struct TNode;
+
+    // Link to the parent node, stored only if the set is built with parent links.
+    struct ParentLink {
+        TNode *parent_ = nullptr;
+    };
+
+    struct NoParentLink {};
+
+    // AVL tree of N nodes is lower than 1.4405 log2(N + 2), so this many levels are enough for any size_t size.
+    constexpr static int32_t MAX_HEIGHT = 92;
+
+    static_assert(sizeof(size_t) <= 8, "MAX_HEIGHT is not enough for sizes wider than 64 bits");
+
+    // Nodes on the way from the root to iterator's node, kept by iterators in place of parent links.
+    struct AncestorStack {
+        AncestorStack() = default;
+
+        AncestorStack(const AncestorStack& other) : depth_(other.depth_) {
+            std::copy(other.ancestors_, other.ancestors_ + other.depth_, ancestors_);
+        }
+
+        AncestorStack& operator=(const AncestorStack& other) {
+            depth_ = other.depth_;
+            std::copy(other.ancestors_, other.ancestors_ + other.depth_, ancestors_);
+            return *this;
+        }
+
+        const TNode *ancestors_[MAX_HEIGHT];
+        int32_t depth_ = 0;
+    };
+
+    struct NoAncestors {};
+
+    /* Nodes on the way from the root down to the place of insertion or deletion. Kept on the stack instead of heap,
+     * so that modifications allocate nothing but the inserted node.
+     */
+    class NodePath {
+      public:
+        void push(TNode* node) {
+            nodes_[size_++] = node;
+        }
+
+        int32_t size() const {
+            return size_;
+        }
+
+        TNode*& operator[](int32_t pos) {
+            return nodes_[pos];
+        }
+
+        TNode* operator[](int32_t pos) const {
+            return nodes_[pos];
+        }
+
+        // Node preceding given one on the path, nullptr for the root.
+        TNode* parent(int32_t pos) const {
+            return (pos > 0 ? nodes_[pos - 1] : nullptr);
+        }
+
+      private:
+        TNode *nodes_[MAX_HEIGHT];
+        int32_t size_ = 0;
+    };
+
+    /* Element in AVL tree storing actual value, three connected elements and balance factor.
+     * Balance factor is the difference between left son's height and right son's height, and is kept in two lowest
+     * bits of the left link, which are always zero in a pointer to aligned node.
+     */
+    struct TNode : std::conditional_t<ParentLinks, ParentLink, NoParentLink> {
       public:
         // Constants showing at which difference children's heights are considered imbalance.
         constexpr static int32_t IMBALANCE_TO_LEFT = 2;
         constexpr static int32_t IMBALANCE_TO_RIGHT = -2;
 
-        // Constant showing at which difference children's heights are considered tilted so that they would become imbalanced after improper shifting.
+        // Constants showing at which difference children's heights are considered tilted so that they would become imbalanced after improper shifting.
         constexpr static int32_t TILTED_LEFT = 1;
+        constexpr static int32_t BALANCED = 0;
         constexpr static int32_t TILTED_RIGHT = -1;
 
-        TNode *left = nullptr;
-        TNode *right = nullptr;
-        TNode *parent = nullptr;
-        T val = T();
+        // Value is constructed and destroyed by the set through its allocator, union only provides aligned storage.
+        union {
+            T val;
+        };
+
+        TNode() {}
+
+        ~TNode() {}
+
+        TNode* left() const {
+            return reinterpret_cast<TNode*>(left_and_balance_ & ~BALANCE_MASK);
+        }
+
+        TNode* right() const {
+            return right_;
+        }
+
+        // Returns parent node, or nullptr if the set is built without parent links.
+        TNode* parent() const {
+            if constexpr (ParentLinks) {
+                return this->parent_;
+            }
+            return nullptr;
+        }
 
-        TNode() {
-            left = nullptr;
-            right = nullptr;
-            parent = nullptr;
-            height = INITIAL_HEIGHT;
-            val();
+        // Returns difference between left son's height and right son's height, one of TILTED_LEFT, BALANCED, TILTED_RIGHT.
+        int32_t balance() const {
+            return static_cast<int32_t>(left_and_balance_ & BALANCE_MASK) - BALANCE_BIAS;
         }
 
-        explicit TNode(T value): val(value) {
-            left = nullptr;
-            right = nullptr;
-            parent = nullptr;
-            height = INITIAL_HEIGHT;
+        void set_balance(int32_t balance) {
+            left_and_balance_ = (left_and_balance_ & ~BALANCE_MASK) | static_cast<uintptr_t>(balance + BALANCE_BIAS);
         }
 
-        // Returns difference between left son's height and right son's height.
-        int32_t diff() {
-            int32_t left_height = (left == nullptr ? 0 : left->height);
-            int32_t right_height = (right == nullptr ? 0 : right->height);
-            return left_height - right_height;
+        // Clears links and balance so that detached node can be attached to a tree as a new leaf.
+        void make_leaf() {
+            left_and_balance_ = static_cast<uintptr_t>(BALANCED + BALANCE_BIAS);
+            right_ = nullptr;
+            set_parent(nullptr);
         }
 
-        // Calculates this node's height based on children's height.
-        void update_height() {
-            int32_t left_height = (left == nullptr ? 0 : left->height);
-            int32_t right_height = (right == nullptr ? 0 : right->height);
-            height = std::max(left_height + 1, right_height + 1);
+        void set_parent(TNode* new_parent) {
+            if constexpr (ParentLinks) {
+                this->parent_ = new_parent;
+            }
         }
 
         void set_right(TNode* new_right) {
-            right = new_right;
+            right_ = new_right;
             if (new_right != nullptr) {
-                new_right->parent = this;
+                new_right->set_parent(this);
             }
-            update_height();
         }
 
         void set_left(TNode* new_left) {
-            left = new_left;
+            left_and_balance_ = reinterpret_cast<uintptr_t>(new_left) | (left_and_balance_ & BALANCE_MASK);
             if (new_left != nullptr) {
-                new_left->parent = this;
+                new_left->set_parent(this);
             }
-            update_height();
         }
 
       private:
-        constexpr static int32_t INITIAL_HEIGHT = 0;
+        // Balance factor is stored shifted by BALANCE_BIAS to fit into [0, 2].
+        constexpr static uintptr_t BALANCE_MASK = 3;
+        constexpr static int32_t BALANCE_BIAS = 1;
 
-        int32_t height = INITIAL_HEIGHT;
+        uintptr_t left_and_balance_ = static_cast<uintptr_t>(BALANCED + BALANCE_BIAS);
+        TNode *right_ = nullptr;
     };
 
+    static_assert(alignof(TNode) >= 4, "two lowest bits of a node pointer must be free to keep balance factor");
+
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<TNode>;
+    using NodeAllocTraits = std::allocator_traits<NodeAllocator>;
+
   public:
+    using allocator_type = Allocator;
+
     // Allows external access to the values stored in tree and finds next/prev element.
-    class iterator {
+    class iterator : private std::conditional_t<ParentLinks, NoAncestors, AncestorStack> {
       public:
+        using iterator_category = std::bidirectional_iterator_tag;
+        using value_type = T;
+        using difference_type = std::ptrdiff_t;
+        using pointer = const T*;
+        using reference = const T&;
+
         iterator() {
             node_ = nullptr;
             root_ = nullptr;
         }
 
-        iterator(Set<T>::TNode* node, Set<T>::TNode* root): node_(node), root_(root) {}
+        iterator(TNode* node, TNode* root, const TNode* last) : node_(node), root_(root), last_(last) {}
 
         const T &operator*() {
             if (node_ == nullptr) {
@@ -100,12 +453,13 @@ class Set {
             return &(node_->val);
         }
 
+        // Iterators are compared by nodes only: the root they remember changes with rotations, so does the last node.
         bool operator==(const iterator& b) const {
-            return (node_ == b.node_) && (root_ == b.root_);
+            return (node_ == b.node_);
         }
 
         bool operator!=(const iterator& b) const {
-            return (node_ != b.node_) || (root_ != b.root_);
+            return (node_ != b.node_);
         }
 
         // Finds next element in the tree, amortized time O(1), real time O(log size).
@@ -113,45 +467,56 @@ class Set {
             if (node_ == nullptr) {
                 return *this;
             }
-            if (node_->right != nullptr) {
-                node_ = node_->right;
-                while (node_->left != nullptr) {
-                    node_ = node_->left;
+            if (node_->right() != nullptr) {
+                descend(node_->right());
+                while (node_->left() != nullptr) {
+                    descend(node_->left());
                 }
                 return *this;
             }
 
+            const TNode *from = node_;
             const TNode *prev = node_;
-            node_ = node_->parent;
-            while (node_ != nullptr && node_->right == prev) {
+            ascend();
+            while (node_ != nullptr && node_->right() == prev) {
                 prev = node_;
-                node_ = node_->parent;
+                ascend();
+            }
+            if (node_ == nullptr) {
+                last_ = from;
             }
             return *this;
         }
 
-        // Finds previous element in the tree, amortized time O(1), real O(log size).
+        /* Finds previous element in the tree, amortized time O(1), real O(log size).
+         * From the end the last node remembered by the iterator is taken in constant time with parent links, otherwise
+         * the path to it is needed.
+         */
         iterator& operator--() {
+            if (node_ == nullptr && ParentLinks && last_ != nullptr) {
+                node_ = last_;
+                return *this;
+            }
             if (node_ == nullptr) {
                 node_ = root_;
-                while (node_->right != nullptr) {
-                    node_ = node_->right;
+                while (node_->right() != nullptr) {
+                    descend(node_->right());
                 }
                 return *this;
             }
-            if (node_->left != nullptr) {
-                node_ = node_->left;
-                while (node_->right != nullptr) {
-                    node_ = node_->right;
+            if (node_->left() != nullptr) {
+                descend(node_->left());
+                while (node_->right() != nullptr) {
+                    descend(node_->right());
                 }
                 return *this;
             }
 
             const TNode *prev = node_;
-            node_ = node_->parent;
-            while (node_ != nullptr && node_->left == prev) {
+            ascend();
+            while (node_ != nullptr && node_->left() == prev) {
                 prev = node_;
-                node_ = node_->parent;
+                ascend();
             }
             if (node_ == nullptr) {
                 assert(0);
@@ -174,352 +539,2661 @@ class Set {
         }
         
       private:
-        const Set<T>::TNode *node_ = nullptr;
-        const Set<T>::TNode *root_ = nullptr;
-    };
+        friend class Set;
 
-    Set() = default;
+        const TNode *node_ = nullptr;
+        const TNode *root_ = nullptr;
+        // The largest node when the end iterator was taken, or the node it was incremented from, to step back to.
+        const TNode* last_ = nullptr;
 
-    template<typename Iterator>
-    Set(Iterator first, Iterator last) : Set() {
-        while (first != last) {
-            insert(*first);
-            ++first;
+        // Remembers node as an ancestor of the node iterator will point to, needed only without parent links.
+        void push_ancestor(const TNode* node) {
+            if constexpr (!ParentLinks) {
+                this->ancestors_[this->depth_++] = node;
+            }
         }
-    }
 
-    Set(std::initializer_list<T> elems) : Set() {
-        for (const T& elem : elems) {
-            insert(elem);
+        int32_t ancestors_count() const {
+            if constexpr (!ParentLinks) {
+                return this->depth_;
+            }
+            return 0;
         }
-    }
-
-    Set(const Set& st) : Set() {
-        copy_all_nodes(st);
-        size_ = st.size_;
-        set_boundary_iters();
-    }
 
-    // Assignment constructor, linear time.
-    Set& operator=(const Set& st) {
-        if (st.begin() == begin_iter_) {
-            return *this;
+        // Forgets ancestors remembered after the first count ones.
+        void keep_ancestors(int32_t count) {
+            if constexpr (!ParentLinks) {
+                this->depth_ = count;
+            }
         }
-        delete_all_nodes();
-        copy_all_nodes(st);
-        size_ = st.size_;
-        set_boundary_iters();
-        return *this;
-    }
-
-    // Destructor, linear time.
-    ~Set() {
-        delete_all_nodes();
-    }
-
-    size_t size() const {
-        return size_;
-    }
-
-    bool empty() const {
-        return (size_ == EMPTY_SET_SIZE);
-    }
 
-    // Inserts element in logarithmic time, simultaneously balances depth of the tree.
-    void insert(const T& elem) {
-        if (find(elem) != end_iter_) {
-            return;
-        }
-        ++size_;
-        if (root_ == nullptr) {
-            root_ = new TNode(elem);
-            set_boundary_iters();
-            return;
+        // Moves to given child of the current node.
+        void descend(const TNode* child) {
+            push_ancestor(node_);
+            node_ = child;
         }
 
-        TNode* node = root_;
-        std::vector<TNode*> path;
-        while (node != nullptr) {
-            path.push_back(node);
-            if (elem < node->val) {
-                node = node->left;
+        // Moves to the parent of the current node, or to nullptr from the root.
+        void ascend() {
+            if constexpr (ParentLinks) {
+                node_ = node_->parent();
             } else {
-                node = node->right;
+                node_ = (this->depth_ == 0 ? nullptr : this->ancestors_[--this->depth_]);
             }
         }
+    };
 
-        std::reverse(path.begin(), path.end());
-        if (path[0]->val < elem) {
-            path[0]->set_right(new TNode(elem));
-        } else {
-            path[0]->set_left(new TNode(elem));
-        }
-        balance_path(path);
-        set_boundary_iters();
-    }
+    // Owns a node extracted from a set, so that the node can be inserted into another set without allocation or copying.
+    class node_type {
+      public:
+        node_type() = default;
 
-    /* Finds node with the closest (less or equal) value and one child, swaps values with original node and deletes node with one child.
-     * The only child of deleted node is reassigned to its parent in place of the deleted. Logarithmic time.
-     */
-    void erase(const T& elem) {
-        if (find(elem) == end_iter_) {
-            return;
+        node_type(node_type&& other) noexcept : node_(other.node_), alloc_(std::move(other.alloc_)) {
+            other.node_ = nullptr;
         }
 
-        --size_;
-        TNode* node = root_;
-        std::vector<TNode*> path;
-        TNode* x = nullptr;
-        while (node != nullptr) {
-            path.push_back(node);
-            if (are_equal_values(elem, node->val)) {
-                x = node;
-                node = node->left;
-                while (node != nullptr) {
-                    path.push_back(node);
-                    node = node->right;
+        node_type& operator=(node_type&& other) noexcept {
+            if (&other != this) {
+                reset();
+                node_ = other.node_;
+                alloc_.reset();
+                if (other.alloc_.has_value()) {
+                    alloc_.emplace(std::move(*other.alloc_));
                 }
-                break;
-            }
-
-            if (elem < node->val) {
-                node = node->left;
-            } else {
-                node = node->right;
+                other.node_ = nullptr;
             }
+            return *this;
         }
 
-        if (x == nullptr) {
-            assert(0);
-        }
-        std::reverse(path.begin(), path.end());
-        if (path[0] != x) {
-            std::swap(x->val, path[0]->val);
+        ~node_type() {
+            reset();
         }
-        delete_node(path[0]);
-        balance_path(path);
-        set_boundary_iters();
-    }
-
-    iterator begin() const {
-        return begin_iter_;
-    }
 
-    iterator end() const {
-        return end_iter_;
-    }
-
-    // Finds element with given value or returns end_iter_ if it doesn't exist. Logarithmic time.
-    iterator find(const T& elem) const {
-        TNode* node = root_;
-        while (node != nullptr) {
-            if (!(node->val < elem) && !(elem < node->val)) {
-                return iterator(node, root_);
-            }
-            if (elem < node->val) {
-                node = node->left;
-            } else {
-                node = node->right;
-            }
+        bool empty() const {
+            return (node_ == nullptr);
         }
-        return end();
-    }
 
-    // Finds the leftmost element with value greater or equal to given value. Logarithmic time.
-    iterator lower_bound(const T& elem) const {
-        if (find(elem) != end()) {
-            return find(elem);
+        explicit operator bool() const {
+            return !empty();
         }
 
-        TNode* node = root_;
-        TNode* last_successful = nullptr;
-        while (node != nullptr) {
-            if (node->val < elem) {
-                node = node->right;
-            } else {
-                last_successful = node;
-                node = node->left;
-            }
+        // Value may be modified while the node is outside of any set.
+        T& value() const {
+            return node_->val;
         }
-        return iterator(last_successful, root_);
-    }
 
-  private:
-    constexpr static size_t EMPTY_SET_SIZE = 0;
+        allocator_type get_allocator() const {
+            return Allocator(*alloc_);
+        }
 
-    size_t size_ = EMPTY_SET_SIZE;
-    TNode *root_ = nullptr;
-    iterator begin_iter_ = iterator(nullptr, nullptr);
-    iterator end_iter_ = iterator(nullptr, nullptr);
+      private:
+        friend class Set;
 
-    // Compare for equivalence without requiring == operator.
-    bool are_equal_values(T val_a, T val_b) {
-        return !(val_a < val_b) && !(val_b < val_a);
-    }
+        TNode *node_ = nullptr;
+        // Empty handle holds no allocator, which may be not default constructible or expensive to construct.
+        std::optional<NodeAllocator> alloc_;
 
-    // Deletes node from tree and correctly reassigns parents and children. Node must have no more than one child.
-    void delete_node(TNode* node) {
-        if (node->parent == nullptr) {
-            root_ = node->left;
-            if (node->left == nullptr) {
-                root_ = node->right;
+        node_type(TNode* node, const NodeAllocator& alloc) : node_(node) {
+            if (node != nullptr) {
+                alloc_.emplace(alloc);
             }
-            if (root_ != nullptr) {
-                root_->parent = nullptr;
-            }
-            delete node;
-            return;
         }
 
-        TNode* parent = node->parent;
-        if (parent->right == node) {
-            parent->set_right(node->left);
-            if (node->left == nullptr) {
-                parent->set_right(node->right);
-            }
-        }
-        else {
-            parent->set_left(node->left);
-            if (node->left == nullptr) {
-                parent->set_left(node->right);
+        void reset() {
+            if (node_ != nullptr) {
+                destroy_node(*alloc_, node_);
+                node_ = nullptr;
             }
         }
-        delete node;
-    }
+    };
 
-    // Balances all nodes on a vertical path in a tree starting from the lowest;
-    void balance_path(std::vector<TNode*>& path) {
-        for (size_t i = 1; i < path.size(); ++i) {
-            path[i]->update_height();
-            if (path[i]->left != nullptr) {
-                path[i]->set_left(balance_node(path[i]->left));
-            }
-            if (path[i]->right != nullptr) {
-                path[i]->set_right(balance_node(path[i]->right));
+    using reverse_iterator = std::reverse_iterator<iterator>;
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    // Result of inserting a node handle, the handle is returned back if insertion didn't take place.
+    struct insert_return_type {
+        iterator position;
+        bool inserted;
+        node_type node;
+    };
+
+    Set() = default;
+
+    explicit Set(const Compare& comp, const Allocator& alloc = Allocator())
+        : ComparatorStorage<Compare>(comp), node_alloc_(alloc) {}
+
+    explicit Set(const Allocator& alloc) : node_alloc_(alloc) {}
+
+    /* Sorted input without equivalent elements, which is checked in one pass if the range can be passed twice, is
+     * built into a balanced tree in linear time. Other input is copied to a buffer and sorted first. Of equivalent
+     * elements it is unspecified which one is kept.
+     */
+    template<typename Iterator>
+    Set(Iterator first, Iterator last, const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : Set(comp, alloc) {
+        if constexpr (is_forward_iterator<Iterator>()) {
+            if (is_sorted_unique(first, last)) {
+                build_from_sorted(first, std::distance(first, last));
+                return;
             }
         }
-        root_ = balance_node(root_);
+        build_from_unsorted(first, last);
+    }
+
+    template<typename Iterator>
+    Set(Iterator first, Iterator last, const Allocator& alloc) : Set(first, last, Compare(), alloc) {}
+
+    /* Builds perfectly balanced tree from sorted input without equivalent elements in linear time, no values are
+     * compared. If the range can't be passed twice to count its length, it is copied to a buffer first.
+     */
+    template<typename Iterator>
+    Set(sorted_unique_t, Iterator first, Iterator last, const Compare& comp = Compare(),
+        const Allocator& alloc = Allocator()) : Set(comp, alloc) {
+        if constexpr (is_forward_iterator<Iterator>()) {
+            build_from_sorted(first, std::distance(first, last));
+        } else {
+            std::vector<T> buffer(first, last);
+            build_from_sorted(std::make_move_iterator(buffer.begin()), buffer.size());
+        }
+    }
+
+    template<typename Iterator>
+    Set(sorted_unique_t, Iterator first, Iterator last, const Allocator& alloc)
+        : Set(sorted_unique, first, last, Compare(), alloc) {}
+
+    // Set built from sorted input without equivalent elements in linear time.
+    template<typename Iterator>
+    static Set from_sorted(Iterator first, Iterator last, const Compare& comp = Compare(),
+                           const Allocator& alloc = Allocator()) {
+        return Set(sorted_unique, first, last, comp, alloc);
+    }
+
+    Set(std::initializer_list<T> elems, const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : Set(elems.begin(), elems.end(), comp, alloc) {}
+
+    Set(std::initializer_list<T> elems, const Allocator& alloc) : Set(elems, Compare(), alloc) {}
+
+    Set(const Set& st)
+        : Set(st.comparator(), Allocator(NodeAllocTraits::select_on_container_copy_construction(st.node_alloc_))) {
+        copy_all_nodes(st);
+        size_ = st.size_;
+        set_boundary_nodes();
+    }
+
+    // Assignment constructor, linear time. Allocator is replaced only if it propagates on copy assignment.
+    Set& operator=(const Set& st) {
+        if (&st == this) {
+            return *this;
+        }
+        delete_all_nodes();
+        this->comparator() = st.comparator();
+        if constexpr (NodeAllocTraits::propagate_on_container_copy_assignment::value) {
+            node_alloc_ = st.node_alloc_;
+        }
+        copy_all_nodes(st);
+        size_ = st.size_;
+        set_boundary_nodes();
+        return *this;
+    }
+
+    // Move constructor takes over the nodes of another set, constant time.
+    Set(Set&& st) noexcept : ComparatorStorage<Compare>(st.comparator()), node_alloc_(std::move(st.node_alloc_)) {
+        steal_nodes(st);
+    }
+
+    /* Move assignment, constant time if allocator propagates or both sets use equal allocators.
+     * Otherwise nodes cannot change owner, so values are moved into new nodes in linear time.
+     */
+    Set& operator=(Set&& st) noexcept(NodeAllocTraits::propagate_on_container_move_assignment::value ||
+                                      NodeAllocTraits::is_always_equal::value) {
+        if (&st == this) {
+            return *this;
+        }
+        delete_all_nodes();
+        this->comparator() = st.comparator();
+        if constexpr (NodeAllocTraits::propagate_on_container_move_assignment::value) {
+            node_alloc_ = std::move(st.node_alloc_);
+        } else if (node_alloc_ != st.node_alloc_) {
+            copy_all_nodes(std::move(st));
+            size_ = st.size_;
+            set_boundary_nodes();
+            st.delete_all_nodes();
+            return *this;
+        }
+        steal_nodes(st);
+        return *this;
+    }
+
+    // Exchanges contents with another set in constant time. Allocators must be equal unless they propagate on swap.
+    void swap(Set& st) noexcept {
+        if constexpr (NodeAllocTraits::propagate_on_container_swap::value) {
+            std::swap(node_alloc_, st.node_alloc_);
+        } else {
+            assert(node_alloc_ == st.node_alloc_);
+        }
+        std::swap(this->comparator(), st.comparator());
+        std::swap(size_, st.size_);
+        std::swap(root_, st.root_);
+        std::swap(leftmost_, st.leftmost_);
+        std::swap(rightmost_, st.rightmost_);
+        std::swap(block_, st.block_);
+        std::swap(block_size_, st.block_size_);
+        std::swap(block_vacant_, st.block_vacant_);
+    }
+
+    friend void swap(Set& a, Set& b) noexcept {
+        a.swap(b);
+    }
+
+    // Destructor, linear time.
+    ~Set() {
+        delete_all_nodes();
+    }
+
+    allocator_type get_allocator() const {
+        return Allocator(node_alloc_);
+    }
+
+    key_compare key_comp() const {
+        return this->comparator();
+    }
+
+    value_compare value_comp() const {
+        return this->comparator();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+#ifdef AVL_SET_STATS
+    const RebalanceStats& rebalance_stats() const {
+        return stats_;
+    }
+#endif
+
+    bool empty() const {
+        return (size_ == EMPTY_SET_SIZE);
+    }
+
+    /* Inserts element in logarithmic time, simultaneously balances depth of the tree.
+     * Returns iterator to the inserted element or to the equal one that prevented insertion, and whether insertion
+     * took place. The tree is descended once, a node is allocated only if there is no equal element.
+     */
+    std::pair<iterator, bool> insert(const T& elem) {
+        return insert_value(elem);
+    }
+
+    // Inserts element moving it into the new node, logarithmic time. Element is left intact if it is already present.
+    std::pair<iterator, bool> insert(T&& elem) {
+        return insert_value(std::move(elem));
+    }
+
+    /* Constructs element in a new node from given arguments and keeps the node only if there is no equal element.
+     * Logarithmic time, the value is never copied or moved.
+     */
+    template<class... Args>
+    std::pair<iterator, bool> emplace(Args&&... args) {
+        TNode* created = create_node(std::forward<Args>(args)...);
+        std::pair<iterator, bool> result = link_node(created);
+        if (!result.second) {
+            destroy_node(created);
+        }
+        return result;
+    }
+
+    /* Inserts element right before the hint if it belongs there, which costs a few comparisons instead of a descent
+     * from the root, so that sorted input is inserted in amortized constant number of comparisons when the hint is
+     * end() or the position after the previous insertion. Otherwise works as insert without hint.
+     * Returns iterator to the inserted element or to the equal one.
+     */
+    iterator insert(iterator hint, const T& elem) {
+        return insert_value(hint, elem);
+    }
+
+    iterator insert(iterator hint, T&& elem) {
+        return insert_value(hint, std::move(elem));
+    }
+
+    // Constructs element in a new node and links it right before the hint if it belongs there, like hinted insert.
+    template<class... Args>
+    iterator emplace_hint(iterator hint, Args&&... args) {
+        TNode* created = create_node(std::forward<Args>(args)...);
+        iterator place;
+        if (place_from_hint(hint, created->val, place)) {
+            return attach_at(created, place);
+        }
+        std::pair<iterator, bool> result = link_node(created);
+        if (!result.second) {
+            destroy_node(created);
+        }
+        return result.first;
+    }
+
+    /* Inserts elements of the range, which may be unsorted, and returns how many of them were new. The batch is sorted
+     * and built into a balanced tree of its own, then merged into this one by splitting it at the batch keys and
+     * joining the parts back, which takes O(m log(n/m + 1)) for batch of m elements and set of n elements instead of
+     * m descents from the root. Elements equal to ones already present are discarded, as by insert.
+     * A batch much smaller than the set is inserted in sorted order one by one, which is cheaper than splitting.
+     */
+    template<typename Iterator>
+    size_t insert_batch(Iterator first, Iterator last) {
+        std::vector<T> buffer(first, last);
+        size_t count = sort_unique(buffer);
+        if (count == 0) {
+            return 0;
+        }
+        if (count * BATCH_DESCENT_RATIO < size_) {
+            size_t inserted = 0;
+            for (size_t i = 0; i < count; ++i) {
+                inserted += insert_value(std::move(buffer[i])).second ? 1 : 0;
+            }
+            return inserted;
+        }
+        auto pos = std::make_move_iterator(buffer.begin());
+        Subtree batch = build_subtree(pos, count);
+        size_t duplicates = 0;
+        set_root(combine_trees(Subtree{root_, subtree_height(root_)}, batch, SetOperation::UNION, duplicates).root);
+        size_ += count - duplicates;
+        return count - duplicates;
+    }
+
+    // Deletes element with given value if it exists, logarithmic time.
+    void erase(const T& elem) {
+        TNode* node = unlink_node(elem);
+        if (node != nullptr) {
+            destroy_node(node);
+        }
+    }
+
+    /* Deletes element the iterator points to and returns iterator to the next one. The iterator must be dereferenceable.
+     * No values are compared: with parent links the tree is retraced up from the node in amortized constant time,
+     * otherwise the path is taken from the iterator and the next element is searched for again, logarithmic time.
+     */
+    iterator erase(iterator pos) {
+        iterator next = pos;
+        ++next;
+        destroy_node(unlink_at(pos));
+        if (next.node_ == nullptr) {
+            return end();
+        }
+        if constexpr (ParentLinks) {
+            next.root_ = root_;
+            return next;
+        }
+        return find(next.node_->val);
+    }
+
+    // Deletes elements from first up to last exclusive and returns iterator to last, linear time in number of deleted.
+    iterator erase(iterator first, iterator last) {
+        while (first != last) {
+            first = erase(first);
+        }
+        return first;
+    }
+
+    /* Deletes all elements not less than lo and less than hi. The range is cut out of the tree by two splits and the
+     * rest is joined back, logarithmic time plus linear in number of deleted elements to free them.
+     */
+    void erase_range(const T& lo, const T& hi) {
+        if (root_ == nullptr || !is_less(lo, hi)) {
+            return;
+        }
+        std::pair<Subtree, Subtree> split_lo = split_tree(Subtree{root_, subtree_height(root_)}, lo);
+        std::pair<Subtree, Subtree> split_hi = split_tree(split_lo.second, hi);
+        size_ -= destroy_subtree(split_hi.first.root);
+        set_root(join_trees(split_lo.first, split_hi.second).root);
+    }
+
+    /* Cuts the set into elements less than key and the rest, returned as two sets, this set is left empty.
+     * The tree is split along the search path in logarithmic time. Sizes of the parts are found by counting nodes of
+     * both in turns, which takes time linear in the smaller part. Nodes of the second part are moved out of the block
+     * of a compacted set, linear time in that part.
+     */
+    std::pair<Set, Set> split(const T& key) {
+        std::pair<Subtree, Subtree> parts = split_tree(Subtree{root_, subtree_height(root_)}, key);
+        Set second(this->comparator(), get_allocator());
+        try {
+            second.root_ = unblock_subtree(parts.second.root);
+        } catch (...) {
+            set_root(join_trees(parts.first, parts.second).root);
+            throw;
+        }
+        second.size_ = size_ - count_first(parts.first.root, second.root_, size_);
+        second.set_root(second.root_);
+        size_ -= second.size_;
+        set_root(parts.first.root);
+        Set first(std::move(*this));
+        return {std::move(first), std::move(second)};
+    }
+
+    /* Concatenates two sets, all elements of the left one must be less than all elements of the right one. Both are
+     * left empty and the result has the left one's comparator. Logarithmic time, plus linear in the right set if it
+     * was compacted, since its nodes have to leave the block. Allocators must be equal.
+     */
+    static Set join(Set&& left, Set&& right) {
+        assert(left.empty() || right.empty() || left.is_less(left.max(), right.min()));
+        right.unblock_nodes();
+        Set joined(std::move(left));
+        joined.append(right, nullptr);
+        return joined;
+    }
+
+    /* Concatenates two sets with a new element between them, which must be greater than all elements of the left set
+     * and less than all elements of the right one.
+     */
+    static Set join(Set&& left, const T& pivot, Set&& right) {
+        right.unblock_nodes();
+        return join_with_node(left, left.create_node(pivot), right);
+    }
+
+    static Set join(Set&& left, T&& pivot, Set&& right) {
+        right.unblock_nodes();
+        return join_with_node(left, left.create_node(std::move(pivot)), right);
+    }
+
+    /* Set algebra consuming both sets: nodes are relinked into the result instead of copied, and the sets are left
+     * empty. The lower tree's root splits the other one and the parts are combined recursively and joined back, which
+     * takes O(m log(n/m + 1)) comparisons for sets of sizes m <= n, so a small or disjoint set costs little.
+     * Nodes left out of the result are freed. Of equal elements the one from the first set is kept. The result has
+     * the first set's comparator and exact size. Allocators must be equal.
+     */
+    friend Set set_union(Set&& first, Set&& second) {
+        return combine_sets(first, second, SetOperation::UNION);
+    }
+
+    friend Set set_intersection(Set&& first, Set&& second) {
+        return combine_sets(first, second, SetOperation::INTERSECTION);
+    }
+
+    // Elements of the first set which are not in the second one.
+    friend Set set_difference(Set&& first, Set&& second) {
+        return combine_sets(first, second, SetOperation::DIFFERENCE);
+    }
+
+    friend Set set_symmetric_difference(Set&& first, Set&& second) {
+        return combine_sets(first, second, SetOperation::SYMMETRIC_DIFFERENCE);
+    }
+
+    // Detaches node with given value from the set and passes its ownership to the returned handle. Logarithmic time.
+    node_type extract(const T& elem) {
+        NodePath path;
+        TNode* node = descend_to_leaf(elem, path);
+        if (node == nullptr) {
+            return node_type();
+        }
+        TNode* standalone = standalone_copy(node);
+        path.push(node);
+        return make_handle(unlink_path(path), standalone);
+    }
+
+    // Detaches node the iterator points to without comparing values, the iterator must be dereferenceable.
+    node_type extract(iterator pos) {
+        TNode* standalone = standalone_copy(const_cast<TNode*>(pos.node_));
+        return make_handle(unlink_at(pos), standalone);
+    }
+
+    /* Links node owned by the handle into the set without any allocation or copying, logarithmic time.
+     * If the set already has an equal element, the node stays in the handle. Handle's allocator must equal the set's one.
+     */
+    insert_return_type insert(node_type&& handle) {
+        if (handle.empty()) {
+            return {end(), false, node_type()};
+        }
+        assert(*handle.alloc_ == node_alloc_);
+        std::pair<iterator, bool> result = link_node(handle.node_);
+        if (!result.second) {
+            return {result.first, false, std::move(handle)};
+        }
+        handle.node_ = nullptr;
+        return {result.first, true, node_type()};
+    }
+
+    // Constant time, logarithmic without parent links since the path to the first element has to be collected.
+    iterator begin() const {
+        if constexpr (ParentLinks) {
+            return iterator(leftmost_, root_, rightmost_);
+        }
+        iterator first(root_, root_, rightmost_);
+        while (first.node_ != nullptr && first.node_->left() != nullptr) {
+            first.descend(first.node_->left());
+        }
+        return first;
+    }
+
+    iterator end() const {
+        return iterator(nullptr, root_, rightmost_);
+    }
+
+    reverse_iterator rbegin() const {
+        return reverse_iterator(end());
+    }
+
+    reverse_iterator rend() const {
+        return reverse_iterator(begin());
+    }
+
+    // The smallest element in constant time, the set must not be empty.
+    const T& min() const {
+        assert(leftmost_ != nullptr);
+        return leftmost_->val;
+    }
+
+    // The largest element in constant time, the set must not be empty.
+    const T& max() const {
+        assert(rightmost_ != nullptr);
+        return rightmost_->val;
+    }
+
+    // Finds element with given value or returns end() if it doesn't exist. Logarithmic time.
+    iterator find(const T& elem) const {
+        bool equal = false;
+        iterator found = search(elem, equal);
+        return (equal ? found : end());
+    }
+
+    bool contains(const T& elem) const {
+        bool equal = false;
+        search(elem, equal);
+        return equal;
+    }
+
+    // Number of elements equal to given value, which is 0 or 1.
+    size_t count(const T& elem) const {
+        return (contains(elem) ? 1 : 0);
+    }
+
+    // Finds the leftmost element with value greater or equal to given value. Logarithmic time.
+    iterator lower_bound(const T& elem) const {
+        return bound(elem, false);
+    }
+
+    // Finds the leftmost element with value greater than given value. Logarithmic time.
+    iterator upper_bound(const T& elem) const {
+        return bound(elem, true);
+    }
+
+    /* Range of elements equal to given value, which holds one element or none. Found in a single descent, the end of
+     * the range is the next element of the found one or, if there is no equal element, the range is empty.
+     */
+    std::pair<iterator, iterator> equal_range(const T& elem) const {
+        bool equal = false;
+        iterator found = search(elem, equal);
+        if (!equal) {
+            return {found, found};
+        }
+        iterator next = found;
+        ++next;
+        return {found, next};
+    }
+
+    /* Moves all nodes into one contiguous block in breadth-first order, preserving the shape of the tree.
+     * Upper levels, which every search passes, then share cache lines and pages instead of being scattered over the heap.
+     * Slots of later erased nodes are reused by insertions, the block is freed when the set is cleared or compacted again.
+     * Linear time and extra memory, invalidates all iterators. If moving a value may throw, values are copied instead.
+     */
+    void compact() {
+        if (root_ == nullptr) {
+            release_block();
+            return;
+        }
+        std::vector<TNode*> order;
+        order.reserve(size_);
+        order.push_back(root_);
+        for (size_t i = 0; i < order.size(); ++i) {
+            if (order[i]->left() != nullptr) {
+                order.push_back(order[i]->left());
+            }
+            if (order[i]->right() != nullptr) {
+                order.push_back(order[i]->right());
+            }
+        }
+
+        TNode* block = NodeAllocTraits::allocate(node_alloc_, order.size());
+        size_t constructed = 0;
+        try {
+            for (; constructed < order.size(); ++constructed) {
+                TNode* node = block + constructed;
+                NodeAllocTraits::construct(node_alloc_, node);
+                try {
+                    NodeAllocTraits::construct(node_alloc_, std::addressof(node->val), std::move_if_noexcept(order[constructed]->val));
+                } catch (...) {
+                    NodeAllocTraits::destroy(node_alloc_, node);
+                    throw;
+                }
+            }
+        } catch (...) {
+            for (size_t i = 0; i < constructed; ++i) {
+                NodeAllocTraits::destroy(node_alloc_, std::addressof(block[i].val));
+                NodeAllocTraits::destroy(node_alloc_, block + i);
+            }
+            NodeAllocTraits::deallocate(node_alloc_, block, order.size());
+            throw;
+        }
+
+        // In breadth-first order children of each node follow children of all previous nodes.
+        size_t next_child = 1;
+        for (size_t i = 0; i < order.size(); ++i) {
+            block[i].set_balance(order[i]->balance());
+            if (order[i]->left() != nullptr) {
+                block[i].set_left(block + next_child++);
+            }
+            if (order[i]->right() != nullptr) {
+                block[i].set_right(block + next_child++);
+            }
+            destroy_node(order[i]);
+        }
+        release_block();
+        block_ = block;
+        block_size_ = order.size();
+        root_ = block;
+        set_boundary_nodes();
+    }
+
+  private:
+    // Small set compares its inline elements with the comparator of its tree without copying it.
+    template<class, size_t, class, class>
+    friend class SmallSet;
+
+    constexpr static size_t EMPTY_SET_SIZE = 0;
+    // Batches smaller than the set size divided by this are inserted element by element rather than merged.
+    constexpr static size_t BATCH_DESCENT_RATIO = 64;
+
+    // Root of a detached part of the tree together with its height, which nodes don't keep.
+    struct Subtree {
+        TNode *root = nullptr;
+        int32_t height = 0;
+    };
+
+    // Operations of combine_trees.
+    enum class SetOperation { UNION, INTERSECTION, DIFFERENCE, SYMMETRIC_DIFFERENCE };
+
+    // Vacant slot of the block keeps the link to the next vacant one.
+    struct VacantSlot {
+        VacantSlot *next = nullptr;
+    };
+
+    size_t size_ = EMPTY_SET_SIZE;
+    TNode *root_ = nullptr;
+    // The smallest and the largest nodes, updated by every modification instead of being searched for.
+    TNode *leftmost_ = nullptr;
+    TNode *rightmost_ = nullptr;
+    // Contiguous storage filled by compact(), its vacant slots are chained in a list.
+    TNode *block_ = nullptr;
+    size_t block_size_ = 0;
+    VacantSlot *block_vacant_ = nullptr;
+    NodeAllocator node_alloc_ = NodeAllocator();
+#ifdef AVL_SET_STATS
+    RebalanceStats stats_;
+#endif
+
+    // Allocates memory for a node through the set's allocator and constructs the value in place from given arguments.
+    template<class... Args>
+    TNode* create_node(Args&&... args) {
+        TNode* node = allocate_node();
+        NodeAllocTraits::construct(node_alloc_, node);
+        try {
+            NodeAllocTraits::construct(node_alloc_, std::addressof(node->val), std::forward<Args>(args)...);
+        } catch (...) {
+            NodeAllocTraits::destroy(node_alloc_, node);
+            deallocate_node(node);
+            throw;
+        }
+        return node;
+    }
+
+    // Destroys node's value and returns its memory to the set's allocator or to the vacant slots of the block.
+    void destroy_node(TNode* node) {
+        NodeAllocTraits::destroy(node_alloc_, std::addressof(node->val));
+        NodeAllocTraits::destroy(node_alloc_, node);
+        deallocate_node(node);
+    }
+
+    // Takes a vacant slot of the block if there is one, so that new nodes stay close to the others.
+    TNode* allocate_node() {
+        if (block_vacant_ == nullptr) {
+            return NodeAllocTraits::allocate(node_alloc_, 1);
+        }
+        VacantSlot* slot = block_vacant_;
+        block_vacant_ = slot->next;
+        return reinterpret_cast<TNode*>(slot);
+    }
+
+    void deallocate_node(TNode* node) {
+        if (!in_block(node)) {
+            NodeAllocTraits::deallocate(node_alloc_, node, 1);
+            return;
+        }
+        block_vacant_ = ::new (static_cast<void*>(node)) VacantSlot{block_vacant_};
+    }
+
+    bool in_block(const TNode* node) const {
+        return !std::less<const TNode*>()(node, block_) && std::less<const TNode*>()(node, block_ + block_size_);
+    }
+
+    // Frees the block, which must have no nodes left in it.
+    void release_block() {
+        if (block_ != nullptr) {
+            NodeAllocTraits::deallocate(node_alloc_, block_, block_size_);
+        }
+        block_ = nullptr;
+        block_size_ = 0;
+        block_vacant_ = nullptr;
+    }
+
+    static void destroy_node(NodeAllocator& alloc, TNode* node) {
+        NodeAllocTraits::destroy(alloc, std::addressof(node->val));
+        NodeAllocTraits::destroy(alloc, node);
+        NodeAllocTraits::deallocate(alloc, node, 1);
+    }
+
+    /* Descends to the element equal to given value and sets the flag if there is one. Otherwise returns the leftmost
+     * element greater than the value, which the descent passes last when turning left.
+     */
+    iterator search(const T& elem, bool& equal) const {
+        iterator found(nullptr, root_, rightmost_);
+        TNode* node = root_;
+        TNode* greater = nullptr;
+        int32_t greater_depth = 0;
+        while (node != nullptr) {
+            int32_t order = compare(elem, node->val);
+            if (order < 0) {
+                greater = node;
+                greater_depth = found.ancestors_count();
+                found.push_ancestor(node);
+                node = node->left();
+            } else if (order > 0) {
+                found.push_ancestor(node);
+                node = node->right();
+            } else {
+                found.node_ = node;
+                equal = true;
+                return found;
+            }
+        }
+        found.node_ = greater;
+        found.keep_ancestors(greater_depth);
+        return found;
+    }
+
+    /* Descends comparing only once per level and returns the leftmost element which is greater than given value, or
+     * not less than it unless strictly greater one is requested.
+     */
+    iterator bound(const T& elem, bool strictly_greater) const {
+        iterator found(nullptr, root_, rightmost_);
+        TNode* node = root_;
+        TNode* last_successful = nullptr;
+        int32_t last_successful_depth = 0;
+        while (node != nullptr) {
+            bool fits = (strictly_greater ? is_less(elem, node->val) : !is_less(node->val, elem));
+            if (fits) {
+                last_successful = node;
+                last_successful_depth = found.ancestors_count();
+            }
+            found.push_ancestor(node);
+            node = (fits ? node->left() : node->right());
+        }
+        found.node_ = last_successful;
+        found.keep_ancestors(last_successful_depth);
+        return found;
+    }
+
+    bool is_less(const T& a, const T& b) const {
+        return this->comparator()(a, b);
+    }
+
+    int32_t compare(const T& a, const T& b) const {
+        return compare_values(this->comparator(), a, b);
+    }
+
+    // Creates node from given value only after checking that there is no equal element yet.
+    template<class Value>
+    std::pair<iterator, bool> insert_value(Value&& elem) {
+        NodePath path;
+        TNode* equal = descend_to_leaf(elem, path);
+        if (equal != nullptr) {
+            return {iterator_to(equal, path), false};
+        }
+        TNode* created = create_node(std::forward<Value>(elem));
+        return {attach_node(created, path), true};
+    }
+
+    template<class Value>
+    iterator insert_value(iterator hint, Value&& elem) {
+        iterator place;
+        if (!place_from_hint(hint, elem, place)) {
+            return insert_value(std::forward<Value>(elem)).first;
+        }
+        TNode* created = create_node(std::forward<Value>(elem));
+        return attach_at(created, place);
+    }
+
+    /* Checks that value belongs right between the hint and its predecessor and finds the node the new leaf is
+     * attached to: the hint if it has no left child, otherwise the predecessor, which then has no right child.
+     * The place is end() in an empty set. Returns false if the value is out of place or equal to one of them.
+     */
+    bool place_from_hint(iterator hint, const T& elem, iterator& place) const {
+        if (root_ == nullptr) {
+            place = end();
+            return true;
+        }
+        if (hint.node_ != nullptr && !(is_less(elem, hint.node_->val))) {
+            return false;
+        }
+        if (hint.node_ == leftmost_) {
+            place = hint;
+            return true;
+        }
+        // The end iterator may have been taken before the largest element changed, so a fresh one is stepped back from.
+        iterator prev = (hint.node_ == nullptr ? end() : hint);
+        --prev;
+        if (!(is_less(prev.node_->val, elem))) {
+            return false;
+        }
+        place = (hint.node_ != nullptr && hint.node_->left() == nullptr ? hint : prev);
+        return true;
+    }
+
+    /* Attaches new node as a child of the place found for it and balances the tree. With parent links the tree is
+     * retraced up from the new leaf, which is amortized constant time, otherwise the path is taken from the iterator.
+     */
+    iterator attach_at(TNode* created, const iterator& place) {
+        if constexpr (ParentLinks) {
+            link_leaf(created, const_cast<TNode*>(place.node_));
+            retrace_after_insert(created);
+            return iterator(created, root_, rightmost_);
+        }
+        NodePath path;
+        if (place.node_ != nullptr) {
+            collect_path(place, path);
+        }
+        return attach_node(created, path);
+    }
+
+    // Detaches node the iterator points to, retracing up through parent links or along the path kept by the iterator.
+    TNode* unlink_at(const iterator& pos) {
+        if constexpr (ParentLinks) {
+            return unlink_with_parents(const_cast<TNode*>(pos.node_));
+        }
+        NodePath path;
+        collect_path(pos, path);
+        return unlink_path(path);
+    }
+
+    // Path from the root down to iterator's node inclusive, taken from ancestors kept by iterator without parent links.
+    void collect_path(const iterator& pos, NodePath& path) const {
+        if constexpr (!ParentLinks) {
+            for (int32_t i = 0; i < pos.ancestors_count(); ++i) {
+                path.push(const_cast<TNode*>(pos.ancestors_[i]));
+            }
+            path.push(const_cast<TNode*>(pos.node_));
+        }
+    }
+
+    /* Attaches new node as a leaf and balances depth of the tree, logarithmic time.
+     * Returns iterator to the equal element and leaves the tree unchanged if there is one.
+     */
+    std::pair<iterator, bool> link_node(TNode* created) {
+        NodePath path;
+        TNode* equal = descend_to_leaf(created->val, path);
+        if (equal != nullptr) {
+            return {iterator_to(equal, path), false};
+        }
+        return {attach_node(created, path), true};
+    }
+
+    /* Descends from the root to the place of given value collecting passed nodes from the root down.
+     * Returns node with equal value, which is not added to the path, or nullptr if the place is vacant.
+     */
+    TNode* descend_to_leaf(const T& elem, NodePath& path) const {
+        TNode* node = root_;
+        while (node != nullptr) {
+            int32_t order = compare(elem, node->val);
+            if (order < 0) {
+                path.push(node);
+                node = node->left();
+            } else if (order > 0) {
+                path.push(node);
+                node = node->right();
+            } else {
+                return node;
+            }
+        }
+        return nullptr;
+    }
+
+    /* Makes new node a child of the last node of the path leading to its place, then balances the tree.
+     * Returns iterator to the new node.
+     */
+    iterator attach_node(TNode* created, const NodePath& path) {
+        if (path.size() == 0) {
+            link_leaf(created, nullptr);
+            return iterator(created, root_, rightmost_);
+        }
+        link_leaf(created, path[path.size() - 1]);
+        int32_t kept_ancestors = balance_path_after_insert(path, created);
+        return iterator_to(created, path, kept_ancestors);
+    }
+
+    // Makes new node a child of given parent on the side its value belongs to, or the root if there is no parent.
+    void link_leaf(TNode* created, TNode* parent) {
+        ++size_;
+        if (parent == nullptr) {
+            root_ = created;
+            leftmost_ = created;
+            rightmost_ = created;
+            return;
+        }
+        if (is_less(parent->val, created->val)) {
+            parent->set_right(created);
+            if (parent == rightmost_) {
+                rightmost_ = created;
+            }
+        } else {
+            parent->set_left(created);
+            if (parent == leftmost_) {
+                leftmost_ = created;
+            }
+        }
+    }
+
+    // Iterator to node whose ancestors are the nodes of the path from the root down.
+    iterator iterator_to(TNode* node, const NodePath& path) const {
+        iterator found(node, root_, rightmost_);
+        for (int32_t i = 0; i < path.size(); ++i) {
+            found.push_ancestor(path[i]);
+        }
+        return found;
+    }
+
+    /* Passes detached node to a handle. A node of the block is replaced by its standalone copy made before detaching,
+     * since the handle frees its node on its own, which is impossible for a part of the block.
+     */
+    node_type make_handle(TNode* node, TNode* standalone) {
+        if (standalone != nullptr) {
+            destroy_node(node);
+            node = standalone;
+        }
+        return node_type(node, node_alloc_);
+    }
+
+    /* Standalone node with the value of a node of the block, moved if that can't throw and copied otherwise, or
+     * nullptr for a node outside the block. The original node keeps its place, so nothing is lost if this throws.
+     */
+    TNode* standalone_copy(TNode* node) {
+        if (!in_block(node)) {
+            return nullptr;
+        }
+        TNode* standalone = NodeAllocTraits::allocate(node_alloc_, 1);
+        NodeAllocTraits::construct(node_alloc_, standalone);
+        try {
+            NodeAllocTraits::construct(node_alloc_, std::addressof(standalone->val), std::move_if_noexcept(node->val));
+        } catch (...) {
+            NodeAllocTraits::destroy(node_alloc_, standalone);
+            NodeAllocTraits::deallocate(node_alloc_, standalone, 1);
+            throw;
+        }
+        return standalone;
+    }
+
+    /* Iterator to new node when only the first ancestors on the path are still valid after rebalancing.
+     * Without parent links the rest are found by descending from the last valid one, which passes no more levels than
+     * rebalancing did.
+     */
+    iterator iterator_to(TNode* node, const NodePath& path, int32_t kept_ancestors) const {
+        if constexpr (ParentLinks) {
+            return iterator(node, root_, rightmost_);
+        }
+        iterator found(node, root_, rightmost_);
+        for (int32_t i = 0; i < kept_ancestors; ++i) {
+            found.push_ancestor(path[i]);
+        }
+        TNode* cur = root_;
+        if (kept_ancestors > 0) {
+            TNode* last = path[kept_ancestors - 1];
+            cur = (is_less(node->val, last->val) ? last->left() : last->right());
+        }
+        while (cur != node) {
+            found.push_ancestor(cur);
+            cur = (is_less(node->val, cur->val) ? cur->left() : cur->right());
+        }
+        return found;
+    }
+
+    // Takes all nodes of another set leaving it empty, allocators must be compatible.
+    void steal_nodes(Set& st) {
+        size_ = st.size_;
+        root_ = st.root_;
+        leftmost_ = st.leftmost_;
+        rightmost_ = st.rightmost_;
+        block_ = st.block_;
+        block_size_ = st.block_size_;
+        block_vacant_ = st.block_vacant_;
+        st.size_ = EMPTY_SET_SIZE;
+        st.root_ = nullptr;
+        st.leftmost_ = nullptr;
+        st.rightmost_ = nullptr;
+        st.block_ = nullptr;
+        st.block_size_ = 0;
+        st.block_vacant_ = nullptr;
+    }
+
+    // Detaches node with given value from the tree and returns it, or returns nullptr if there is no such value.
+    TNode* unlink_node(const T& elem) {
+        TNode* node = root_;
+        NodePath path;
+        while (node != nullptr) {
+            path.push(node);
+            int32_t order = compare(elem, node->val);
+            if (order < 0) {
+                node = node->left();
+            } else if (order > 0) {
+                node = node->right();
+            } else {
+                return unlink_path(path);
+            }
+        }
+        return nullptr;
+    }
+
+    /* Detaches the last node of the path from the root and returns it.
+     * Node with two children is replaced by the closest smaller node, which has no more than one child and is detached
+     * from its own place first. The only child of detached node is reassigned to its parent. Logarithmic time.
+     * Nodes are relinked rather than values swapped, so other elements stay in their nodes.
+     */
+    TNode* unlink_path(NodePath& path) {
+        int32_t x_pos = path.size() - 1;
+        TNode* x = path[x_pos];
+        TNode* node = x->left();
+        if (node != nullptr && x->right() != nullptr) {
+            while (node != nullptr) {
+                path.push(node);
+                node = node->right();
+            }
+        }
+
+        // The smallest node has no left child, so its successor is either in the right subtree or the parent.
+        if (x == leftmost_) {
+            leftmost_ = (x->right() != nullptr ? leftmost_in(x->right()) : path.parent(x_pos));
+        }
+        if (x == rightmost_) {
+            rightmost_ = (x->left() != nullptr ? rightmost_in(x->left()) : path.parent(x_pos));
+        }
+        TNode* removed = path[path.size() - 1];
+        TNode* parent = path.parent(path.size() - 1);
+        bool shrunk_left = (parent != nullptr && parent->left() == removed);
+        replace_child(parent, removed, (removed->left() != nullptr ? removed->left() : removed->right()));
+        if (removed != x) {
+            removed->set_left(x->left());
+            removed->set_right(x->right());
+            removed->set_balance(x->balance());
+            replace_child(path.parent(x_pos), x, removed);
+            path[x_pos] = removed;
+        }
+        balance_path_after_erase(path, shrunk_left);
+        --size_;
+        x->make_leaf();
+        return x;
+    }
+
+    /* Detaches the node using parent links instead of a path, same as unlink_path otherwise. The closest smaller node
+     * replacing a node with two children is found by descending the left subtree, then the tree is retraced up.
+     */
+    TNode* unlink_with_parents(TNode* x) {
+        TNode* removed = x;
+        if (x->left() != nullptr && x->right() != nullptr) {
+            removed = rightmost_in(x->left());
+        }
+        if (x == leftmost_) {
+            leftmost_ = (x->right() != nullptr ? leftmost_in(x->right()) : x->parent());
+        }
+        if (x == rightmost_) {
+            rightmost_ = (x->left() != nullptr ? rightmost_in(x->left()) : x->parent());
+        }
+        TNode* parent = removed->parent();
+        bool shrunk_left = (parent != nullptr && parent->left() == removed);
+        replace_child(parent, removed, (removed->left() != nullptr ? removed->left() : removed->right()));
+        if (removed != x) {
+            removed->set_left(x->left());
+            removed->set_right(x->right());
+            removed->set_balance(x->balance());
+            replace_child(x->parent(), x, removed);
+            if (parent == x) {
+                parent = removed;
+            }
+        }
+        retrace_after_erase(parent, shrunk_left);
+        --size_;
+        x->make_leaf();
+        return x;
+    }
+
+    // Puts new subtree in place of parent's child, or makes it the whole tree if there is no parent.
+    void replace_child(TNode* parent, TNode* old_child, TNode* new_child) {
+        if (parent == nullptr) {
+            root_ = new_child;
+            if (new_child != nullptr) {
+                new_child->set_parent(nullptr);
+            }
+        } else if (parent->left() == old_child) {
+            parent->set_left(new_child);
+        } else {
+            parent->set_right(new_child);
+        }
+    }
+
+    /* Walks up from the parent of a new leaf, updating balance factors while subtree heights grow.
+     * The walk stops at the first node whose height does not change, which is also the case after a rotation.
+     * Returns how many nodes from the beginning of the path are still ancestors of the new leaf.
+     */
+    int32_t balance_path_after_insert(const NodePath& path, TNode* grown) {
+        for (int32_t i = path.size() - 1; i >= 0; --i) {
+            TNode* node = path[i];
+            count_visited_node();
+            int32_t balance = node->balance() + (node->left() == grown ? 1 : -1);
+            if (balance == TNode::IMBALANCE_TO_LEFT || balance == TNode::IMBALANCE_TO_RIGHT) {
+                replace_child(path.parent(i), node, balance_node(node, balance));
+                return i;
+            }
+            node->set_balance(balance);
+            if (balance == TNode::BALANCED) {
+                break;
+            }
+            grown = node;
+        }
+        return path.size();
+    }
+
+    /* Walks up from the parent of a deleted node, updating balance factors while subtree heights shrink.
+     * Unlike insertion, rotation may shrink the subtree too, so the walk can go on after it.
+     */
+    void balance_path_after_erase(const NodePath& path, bool shrunk_left) {
+        for (int32_t i = path.size() - 2; i >= 0; --i) {
+            TNode* node = path[i];
+            TNode* parent = path.parent(i);
+            count_visited_node();
+            int32_t balance = node->balance() + (shrunk_left ? -1 : 1);
+            if (balance == TNode::TILTED_LEFT || balance == TNode::TILTED_RIGHT) {
+                node->set_balance(balance);
+                return;
+            }
+            if (balance == TNode::BALANCED) {
+                node->set_balance(balance);
+            } else {
+                TNode* new_root = balance_node(node, balance);
+                replace_child(parent, node, new_root);
+                if (new_root->balance() != TNode::BALANCED) {
+                    return;
+                }
+                node = new_root;
+            }
+            shrunk_left = (parent != nullptr && parent->left() == node);
+        }
+    }
+
+    // Same as balance_path_after_insert, walking up through parent links from the new leaf.
+    void retrace_after_insert(TNode* grown) {
+        for (TNode* node = grown->parent(); node != nullptr; node = grown->parent()) {
+            count_visited_node();
+            int32_t balance = node->balance() + (node->left() == grown ? 1 : -1);
+            if (balance == TNode::IMBALANCE_TO_LEFT || balance == TNode::IMBALANCE_TO_RIGHT) {
+                TNode* parent = node->parent();
+                replace_child(parent, node, balance_node(node, balance));
+                return;
+            }
+            node->set_balance(balance);
+            if (balance == TNode::BALANCED) {
+                return;
+            }
+            grown = node;
+        }
+    }
+
+    // Same as balance_path_after_erase, walking up through parent links from the parent of the deleted node.
+    void retrace_after_erase(TNode* node, bool shrunk_left) {
+        while (node != nullptr) {
+            TNode* parent = node->parent();
+            count_visited_node();
+            int32_t balance = node->balance() + (shrunk_left ? -1 : 1);
+            if (balance == TNode::TILTED_LEFT || balance == TNode::TILTED_RIGHT) {
+                node->set_balance(balance);
+                return;
+            }
+            if (balance == TNode::BALANCED) {
+                node->set_balance(balance);
+            } else {
+                TNode* new_root = balance_node(node, balance);
+                replace_child(parent, node, new_root);
+                if (new_root->balance() != TNode::BALANCED) {
+                    return;
+                }
+                node = new_root;
+            }
+            shrunk_left = (parent != nullptr && parent->left() == node);
+            node = parent;
+        }
+    }
+
+    // Height of the subtree found by following the taller child, logarithmic time.
+    static int32_t subtree_height(TNode* node) {
+        int32_t height = 0;
+        while (node != nullptr) {
+            ++height;
+            node = (node->balance() == TNode::TILTED_RIGHT ? node->right() : node->left());
+        }
+        return height;
+    }
+
+    static Subtree left_subtree(Subtree tree) {
+        return Subtree{tree.root->left(), tree.height - (tree.root->balance() == TNode::TILTED_RIGHT ? 2 : 1)};
+    }
+
+    static Subtree right_subtree(Subtree tree) {
+        return Subtree{tree.root->right(), tree.height - (tree.root->balance() == TNode::TILTED_LEFT ? 2 : 1)};
+    }
+
+    template<typename Iterator>
+    constexpr static bool is_forward_iterator() {
+        return std::is_base_of<std::forward_iterator_tag, typename std::iterator_traits<Iterator>::iterator_category>::value;
+    }
+
+    // Checks that each element is less than the next one, stops at the first one which is not.
+    template<typename Iterator>
+    bool is_sorted_unique(Iterator first, Iterator last) const {
+        if (first == last) {
+            return true;
+        }
+        for (Iterator next = std::next(first); next != last; ++first, ++next) {
+            if (!is_less(*first, *next)) {
+                return false;
+            }
+        }
+        return true;
+    }
+
+    // Replaces contents of the empty set with a balanced tree of given number of sorted elements taken from the iterator.
+    template<typename Iterator>
+    void build_from_sorted(Iterator first, size_t count) {
+        set_root(build_subtree(first, count).root);
+        size_ = count;
+    }
+
+    /* Copies elements to a buffer, sorts it and leaves one of each run of equivalent elements, then builds the tree
+     * from the buffer moving values out of it. Takes O(n log n) comparisons and no rebalancing.
+     */
+    template<typename Iterator>
+    void build_from_unsorted(Iterator first, Iterator last) {
+        std::vector<T> buffer(first, last);
+        size_t count = sort_unique(buffer);
+        build_from_sorted(std::make_move_iterator(buffer.begin()), count);
+    }
+
+    // Sorts the buffer and moves one element of each run of equivalent ones to the front, returns their number.
+    size_t sort_unique(std::vector<T>& buffer) const {
+        std::sort(buffer.begin(), buffer.end(), [this](const T& a, const T& b) { return is_less(a, b); });
+        auto unique_end = std::unique(buffer.begin(), buffer.end(),
+                                      [this](const T& a, const T& b) { return !is_less(a, b); });
+        return unique_end - buffer.begin();
+    }
+
+    /* Builds subtree of given number of elements taken in order from the iterator, which is advanced past them.
+     * The middle element becomes the root and halves are built recursively, so sizes of the halves differ by no more
+     * than one and so do their heights. Nodes already built are freed if constructing a value throws.
+     */
+    template<typename Iterator>
+    Subtree build_subtree(Iterator& pos, size_t count) {
+        if (count == 0) {
+            return Subtree();
+        }
+        size_t left_count = (count - 1) / 2;
+        Subtree left = build_subtree(pos, left_count);
+        TNode* node = nullptr;
+        try {
+            node = create_node(*pos);
+            ++pos;
+            Subtree right = build_subtree(pos, count - 1 - left_count);
+            node->set_left(left.root);
+            node->set_right(right.root);
+            node->set_balance(left.height - right.height);
+            return Subtree{node, std::max(left.height, right.height) + 1};
+        } catch (...) {
+            destroy_subtree(left.root);
+            if (node != nullptr) {
+                destroy_node(node);
+            }
+            throw;
+        }
+    }
+
+    // Makes given subtree the whole tree and finds its boundary nodes.
+    void set_root(TNode* root) {
+        root_ = root;
+        if (root_ != nullptr) {
+            root_->set_parent(nullptr);
+        }
+        set_boundary_nodes();
+    }
+
+    /* Joins two trees and a single middle node, all values of the left tree must be less than the middle one and all
+     * values of the right tree greater. The middle node is attached down the spine of the higher tree where heights
+     * become close, and nodes above are rebalanced on the way back. Time is proportional to the difference of heights.
+     */
+    Subtree join_trees(Subtree left, TNode* middle, Subtree right) {
+        if (left.height > right.height + 1) {
+            Subtree left_left = left_subtree(left);
+            Subtree joined = join_trees(right_subtree(left), middle, right);
+            left.root->set_right(joined.root);
+            return fix_joined(left.root, left_left.height, joined.height);
+        }
+        if (right.height > left.height + 1) {
+            Subtree right_right = right_subtree(right);
+            Subtree joined = join_trees(left, middle, left_subtree(right));
+            right.root->set_left(joined.root);
+            return fix_joined(right.root, joined.height, right_right.height);
+        }
+        middle->set_left(left.root);
+        middle->set_right(right.root);
+        middle->set_balance(left.height - right.height);
+        return Subtree{middle, std::max(left.height, right.height) + 1};
+    }
+
+    /* Sets balance of node from heights of its children after one of them was replaced, rotating if they differ by 2.
+     * Rotated subtree is as high as its higher child was if the new root is balanced, and one level higher otherwise.
+     */
+    Subtree fix_joined(TNode* node, int32_t left_height, int32_t right_height) {
+        int32_t balance = left_height - right_height;
+        if (balance == TNode::IMBALANCE_TO_LEFT || balance == TNode::IMBALANCE_TO_RIGHT) {
+            TNode* new_root = balance_node(node, balance);
+            return Subtree{new_root, std::max(left_height, right_height) + (new_root->balance() == TNode::BALANCED ? 0 : 1)};
+        }
+        node->set_balance(balance);
+        return Subtree{node, std::max(left_height, right_height) + 1};
+    }
+
+    // Joins two trees, all values of the left one must be less than values of the right one.
+    Subtree join_trees(Subtree left, Subtree right) {
+        if (right.root == nullptr) {
+            return left;
+        }
+        TNode* first = nullptr;
+        Subtree rest = detach_first(right, first);
+        return join_trees(left, first, rest);
+    }
+
+    // Detaches the leftmost node of the tree, rebalancing the rest by joining it back level by level.
+    Subtree detach_first(Subtree tree, TNode*& first) {
+        if (tree.root->left() == nullptr) {
+            first = tree.root;
+            return Subtree{tree.root->right(), tree.height - 1};
+        }
+        Subtree right = right_subtree(tree);
+        Subtree left = detach_first(left_subtree(tree), first);
+        return join_trees(left, tree.root, right);
+    }
+
+    /* Splits the tree into values less than key and the rest. Each node on the search path is joined with the part of
+     * the tree on its side, logarithmic time in total since joined trees grow in height along the way up.
+     */
+    std::pair<Subtree, Subtree> split_tree(Subtree tree, const T& key) {
+        if (tree.root == nullptr) {
+            return {Subtree(), Subtree()};
+        }
+        Subtree left = left_subtree(tree);
+        Subtree right = right_subtree(tree);
+        if (is_less(tree.root->val, key)) {
+            std::pair<Subtree, Subtree> parts = split_tree(right, key);
+            return {join_trees(left, tree.root, parts.first), parts.second};
+        }
+        std::pair<Subtree, Subtree> parts = split_tree(left, key);
+        return {parts.first, join_trees(parts.second, tree.root, right)};
+    }
+
+    /* Splits the tree into values less than key and values greater than it. The node equal to key, if any, is
+     * detached from both parts and returned in match.
+     */
+    std::pair<Subtree, Subtree> split_tree(Subtree tree, const T& key, TNode*& match) {
+        if (tree.root == nullptr) {
+            return {Subtree(), Subtree()};
+        }
+        Subtree left = left_subtree(tree);
+        Subtree right = right_subtree(tree);
+        int32_t order = compare(tree.root->val, key);
+        if (order == 0) {
+            match = tree.root;
+            return {left, right};
+        }
+        if (order < 0) {
+            std::pair<Subtree, Subtree> parts = split_tree(right, key, match);
+            return {join_trees(left, tree.root, parts.first), parts.second};
+        }
+        std::pair<Subtree, Subtree> parts = split_tree(left, key, match);
+        return {parts.first, join_trees(parts.second, tree.root, right)};
+    }
+
+    static Set join_with_node(Set& left, TNode* pivot, Set& right) {
+        assert(left.empty() || left.is_less(left.max(), pivot->val));
+        assert(right.empty() || left.is_less(pivot->val, right.min()));
+        Set joined(std::move(left));
+        joined.append(right, pivot);
+        return joined;
+    }
+
+    /* Joins all nodes of another set, whose elements are greater, and optional middle node to this set, leaving the
+     * other set empty. The other set must have no block. Allocators must be equal.
+     */
+    void append(Set& st, TNode* middle) {
+        assert(node_alloc_ == st.node_alloc_ && st.block_ == nullptr);
+        Subtree left{root_, subtree_height(root_)};
+        Subtree right{st.root_, subtree_height(st.root_)};
+        set_root((middle == nullptr ? join_trees(left, right) : join_trees(left, middle, right)).root);
+        size_ += st.size_ + (middle == nullptr ? 0 : 1);
+        st.forget_nodes();
+    }
+
+    /* Combines nodes of two sets by the operation into a new set with the first one's comparator and storage, leaving
+     * both sets empty. Size of the result follows from sizes of the sets and the number of their common elements.
+     */
+    static Set combine_sets(Set& first, Set& second, SetOperation operation) {
+        assert(first.node_alloc_ == second.node_alloc_);
+        second.unblock_nodes();
+        Set combined(std::move(first));
+        size_t first_size = combined.size_;
+        size_t second_size = second.size_;
+        Subtree first_tree{combined.root_, subtree_height(combined.root_)};
+        Subtree second_tree{second.root_, subtree_height(second.root_)};
+        second.forget_nodes();
+        size_t matches = 0;
+        combined.set_root(combined.combine_trees(first_tree, second_tree, operation, matches).root);
+        switch (operation) {
+            case SetOperation::UNION:
+                combined.size_ = first_size + second_size - matches;
+                break;
+            case SetOperation::INTERSECTION:
+                combined.size_ = matches;
+                break;
+            case SetOperation::DIFFERENCE:
+                combined.size_ = first_size - matches;
+                break;
+            case SetOperation::SYMMETRIC_DIFFERENCE:
+                combined.size_ = first_size + second_size - 2 * matches;
+                break;
+        }
+        return combined;
+    }
+
+    // Empties the set without destroying nodes, which were passed to another set.
+    void forget_nodes() {
+        root_ = nullptr;
+        leftmost_ = nullptr;
+        rightmost_ = nullptr;
+        size_ = EMPTY_SET_SIZE;
+    }
+
+    // Moves all nodes of a compacted set out of its block and frees the block, so that nodes can change owner.
+    void unblock_nodes() {
+        if (block_ != nullptr) {
+            set_root(unblock_subtree(root_));
+            release_block();
+        }
+    }
+
+    /* Replaces nodes of the subtree which lie in the block with standalone ones, moving values, and returns the new
+     * root. Children are replaced before their parent, so the tree stays whole if allocation or copying throws.
+     */
+    TNode* unblock_subtree(TNode* node) {
+        if (block_ == nullptr || node == nullptr) {
+            return node;
+        }
+        node->set_left(unblock_subtree(node->left()));
+        node->set_right(unblock_subtree(node->right()));
+        TNode* standalone = standalone_copy(node);
+        if (standalone == nullptr) {
+            return node;
+        }
+        standalone->set_left(node->left());
+        standalone->set_right(node->right());
+        standalone->set_balance(node->balance());
+        destroy_node(node);
+        return standalone;
+    }
+
+    /* Counts nodes of the first tree given the total number of nodes in both. The trees are traversed in turns until
+     * one of them is exhausted, so time is linear in the smaller one.
+     */
+    static size_t count_first(TNode* first, TNode* second, size_t total) {
+        std::stack<TNode*> first_nodes;
+        std::stack<TNode*> second_nodes;
+        if (first != nullptr) {
+            first_nodes.push(first);
+        }
+        if (second != nullptr) {
+            second_nodes.push(second);
+        }
+        size_t first_count = 0;
+        size_t second_count = 0;
+        while (!first_nodes.empty() && !second_nodes.empty()) {
+            first_count += visit_next(first_nodes);
+            second_count += visit_next(second_nodes);
+        }
+        return (first_nodes.empty() ? first_count : total - second_count);
+    }
+
+    // Pops a node of traversal and pushes its children, returns 1 for the visited node.
+    static size_t visit_next(std::stack<TNode*>& nodes) {
+        TNode* cur = nodes.top();
+        nodes.pop();
+        if (cur->left() != nullptr) {
+            nodes.push(cur->left());
+        }
+        if (cur->right() != nullptr) {
+            nodes.push(cur->right());
+        }
+        return 1;
+    }
+
+    /* Combines two trees by the operation and counts their common elements in matches. The root of the lower tree,
+     * which is likely the smaller one, splits the other tree, the halves are combined with the parts recursively and
+     * joined back with or without the root in the middle. Of equal elements the one from the first tree is kept if
+     * the result needs it, nodes left out of the result are destroyed. O(m log(n/m + 1)) for trees of sizes m <= n.
+     */
+    Subtree combine_trees(Subtree first, Subtree second, SetOperation operation, size_t& matches) {
+        if (first.root == nullptr || second.root == nullptr) {
+            Subtree rest = (first.root == nullptr ? second : first);
+            bool keeps_rest = (operation == SetOperation::UNION || operation == SetOperation::SYMMETRIC_DIFFERENCE ||
+                               (operation == SetOperation::DIFFERENCE && first.root != nullptr));
+            if (keeps_rest) {
+                return rest;
+            }
+            destroy_subtree(rest.root);
+            return Subtree();
+        }
+        bool pivot_is_first = (first.height <= second.height);
+        Subtree pivot_tree = (pivot_is_first ? first : second);
+        TNode* pivot = pivot_tree.root;
+        TNode* match = nullptr;
+        std::pair<Subtree, Subtree> parts = split_tree(pivot_is_first ? second : first, pivot->val, match);
+        Subtree pivot_left = left_subtree(pivot_tree);
+        Subtree pivot_right = right_subtree(pivot_tree);
+        Subtree left = (pivot_is_first ? combine_trees(pivot_left, parts.first, operation, matches)
+                                       : combine_trees(parts.first, pivot_left, operation, matches));
+        Subtree right = (pivot_is_first ? combine_trees(pivot_right, parts.second, operation, matches)
+                                        : combine_trees(parts.second, pivot_right, operation, matches));
+        TNode* middle = nullptr;
+        if (match != nullptr) {
+            ++matches;
+            TNode* from_first = (pivot_is_first ? pivot : match);
+            destroy_node(pivot_is_first ? match : pivot);
+            if (operation == SetOperation::UNION || operation == SetOperation::INTERSECTION) {
+                middle = from_first;
+            } else {
+                destroy_node(from_first);
+            }
+        } else if (operation == SetOperation::UNION || operation == SetOperation::SYMMETRIC_DIFFERENCE ||
+                   (operation == SetOperation::DIFFERENCE && pivot_is_first)) {
+            middle = pivot;
+        } else {
+            destroy_node(pivot);
+        }
+        return (middle == nullptr ? join_trees(left, right) : join_trees(left, middle, right));
+    }
+
+    // Destroys all nodes of the subtree and returns their number, linear time.
+    size_t destroy_subtree(TNode* root) {
+        size_t count = 0;
+        std::stack<TNode*> to_delete_nodes;
+        if (root != nullptr) {
+            to_delete_nodes.push(root);
+        }
+        while (!to_delete_nodes.empty()) {
+            TNode* cur = to_delete_nodes.top();
+            to_delete_nodes.pop();
+            if (cur->left() != nullptr) {
+                to_delete_nodes.push(cur->left());
+            }
+            if (cur->right() != nullptr) {
+                to_delete_nodes.push(cur->right());
+            }
+            destroy_node(cur);
+            ++count;
+        }
+        return count;
     }
 
     /* Makes this set a deep copy of another in linear time by traversing the original tree and copying each node's children.
      * Two stacks are used to simultaneously process both copied nodes and their original counterparts.
+     * Values are moved out of the original if it is passed as rvalue.
      */
-    void copy_all_nodes(const Set& st) {
+    template<class Source>
+    void copy_all_nodes(Source&& st) {
+        using Value = std::conditional_t<std::is_lvalue_reference<Source>::value, const T&, T&&>;
         if (st.root_ == nullptr) {
             return;
         }
-        std::stack<TNode*> copied_nodes;
-        std::stack<TNode*> original_nodes;
-        root_ = new TNode(st.root_->val);
-        copied_nodes.push(root_);
-        original_nodes.push(st.root_);
-
-        while (!original_nodes.empty()) {
-            auto working_copy = copied_nodes.top();
-            copied_nodes.pop();
-            auto original_node = original_nodes.top();
-            original_nodes.pop();
-
-            if (original_node->left != nullptr) {
-                working_copy->set_left(new TNode(original_node->left->val));
-                copied_nodes.push(working_copy->left);
-                original_nodes.push(original_node->left);
+        std::stack<TNode*> copied_nodes;
+        std::stack<TNode*> original_nodes;
+        root_ = create_node(static_cast<Value>(st.root_->val));
+        copied_nodes.push(root_);
+        original_nodes.push(st.root_);
+
+        while (!original_nodes.empty()) {
+            auto working_copy = copied_nodes.top();
+            copied_nodes.pop();
+            auto original_node = original_nodes.top();
+            original_nodes.pop();
+            working_copy->set_balance(original_node->balance());
+
+            if (original_node->left() != nullptr) {
+                working_copy->set_left(create_node(static_cast<Value>(original_node->left()->val)));
+                copied_nodes.push(working_copy->left());
+                original_nodes.push(original_node->left());
+            }
+            if (original_node->right() != nullptr) {
+                working_copy->set_right(create_node(static_cast<Value>(original_node->right()->val)));
+                copied_nodes.push(working_copy->right());
+                original_nodes.push(original_node->right());
+            }
+        }
+    }
+
+    /* Deletes each node while traversing tree using stack for non-processed nodes, linear time.
+     * Constant time if nodes are owned by a monotonic buffer and need no destruction, see nodes_need_release().
+     */
+    void delete_all_nodes() {
+        if (root_ == nullptr) {
+            release_block();
+            return;
+        }
+
+        if (nodes_need_release()) {
+            destroy_subtree(root_);
+        }
+        release_block();
+        root_ = nullptr;
+        leftmost_ = nullptr;
+        rightmost_ = nullptr;
+        size_ = 0;
+    }
+
+    /* Checks whether nodes have to be destroyed and deallocated one by one when the set is cleared.
+     * Trivially destructible values allocated from a monotonic buffer can be abandoned: the buffer ignores deallocation
+     * and frees all its memory at once.
+     */
+    bool nodes_need_release() const {
+        if constexpr (std::is_trivially_destructible<T>::value &&
+                      std::is_same<NodeAllocator, std::pmr::polymorphic_allocator<TNode>>::value) {
+            return dynamic_cast<std::pmr::monotonic_buffer_resource*>(node_alloc_.resource()) == nullptr;
+        }
+        return true;
+    }
+
+    /* Balances nodes' depth by swapping this node and its children so that children's heights differ for no more than 1.
+     * Takes the balance factor node would have, IMBALANCE_TO_LEFT or IMBALANCE_TO_RIGHT, since it does not fit into the node.
+     * If the heavier child is tilted the other way, it is rotated first. Balance factors are set by classic AVL rules:
+     * after a double rotation they depend only on the former balance of the new root, after a single one the new root
+     * stays tilted only if the heavier child was balanced, which happens only on erase and keeps subtree's height.
+     */
+    TNode* balance_node(TNode* old_root, int32_t balance) {
+        if (balance == TNode::IMBALANCE_TO_RIGHT) {
+            TNode* child = old_root->right();
+            if (child->balance() == TNode::TILTED_LEFT) {
+                TNode* grandchild = child->left();
+                old_root->set_balance(grandchild->balance() == TNode::TILTED_RIGHT ? TNode::TILTED_LEFT : TNode::BALANCED);
+                child->set_balance(grandchild->balance() == TNode::TILTED_LEFT ? TNode::TILTED_RIGHT : TNode::BALANCED);
+                grandchild->set_balance(TNode::BALANCED);
+                old_root->set_right(increase_right_height(child));
+                return increase_left_height(old_root);
+            }
+            bool child_balanced = (child->balance() == TNode::BALANCED);
+            old_root->set_balance(child_balanced ? TNode::TILTED_RIGHT : TNode::BALANCED);
+            child->set_balance(child_balanced ? TNode::TILTED_LEFT : TNode::BALANCED);
+            return increase_left_height(old_root);
+        }
+
+        TNode* child = old_root->left();
+        if (child->balance() == TNode::TILTED_RIGHT) {
+            TNode* grandchild = child->right();
+            old_root->set_balance(grandchild->balance() == TNode::TILTED_LEFT ? TNode::TILTED_RIGHT : TNode::BALANCED);
+            child->set_balance(grandchild->balance() == TNode::TILTED_RIGHT ? TNode::TILTED_LEFT : TNode::BALANCED);
+            grandchild->set_balance(TNode::BALANCED);
+            old_root->set_left(increase_left_height(child));
+            return increase_right_height(old_root);
+        }
+        bool child_balanced = (child->balance() == TNode::BALANCED);
+        old_root->set_balance(child_balanced ? TNode::TILTED_LEFT : TNode::BALANCED);
+        child->set_balance(child_balanced ? TNode::TILTED_RIGHT : TNode::BALANCED);
+        return increase_right_height(old_root);
+    }
+
+    // Makes right child new root in this subtree, thus shifting old root to be its left child and increasing left child's height.
+    TNode* increase_left_height(TNode* old_root) {
+        count_rotation();
+        TNode* root_parent = old_root->parent();
+        TNode* new_root = old_root->right();
+
+        old_root->set_right(new_root->left());
+        new_root->set_left(old_root);
+        new_root->set_parent(root_parent);
+        return new_root;
+    }
+
+    // Makes left child new root in this subtree, thus shifting old root to be its right child and increasing right child's height.
+    TNode* increase_right_height(TNode* old_root) {
+        count_rotation();
+        TNode* root_parent = old_root->parent();
+        TNode* new_root = old_root->left();
+
+        old_root->set_left(new_root->right());
+        new_root->set_right(old_root);
+        new_root->set_parent(root_parent);
+        return new_root;
+    }
+
+    void count_visited_node() {
+#ifdef AVL_SET_STATS
+        ++stats_.visited_nodes;
+#endif
+    }
+
+    void count_rotation() {
+#ifdef AVL_SET_STATS
+        ++stats_.rotations;
+#endif
+    }
+
+    // Finds the smallest and the largest nodes after the whole tree is rebuilt, logarithmic time.
+    void set_boundary_nodes() {
+        leftmost_ = (root_ != nullptr ? leftmost_in(root_) : nullptr);
+        rightmost_ = (root_ != nullptr ? rightmost_in(root_) : nullptr);
+    }
+
+    static TNode* leftmost_in(TNode* node) {
+        while (node->left() != nullptr) {
+            node = node->left();
+        }
+        return node;
+    }
+
+    static TNode* rightmost_in(TNode* node) {
+        while (node->right() != nullptr) {
+            node = node->right();
+        }
+        return node;
+    }
+};
+
+/* AVL tree set storing all nodes in one contiguous vector and linking them by 32-bit indices instead of pointers.
+ * Links and height take 16 bytes per node against 24 in Set and there is no per-node heap allocation. The tree has
+ * no pointers inside, so storage can be relocated, copied or serialized as a whole without fixing links.
+ * Slots of erased elements are reused by later insertions.
+ * Iterators refer to nodes by index and stay valid when storage grows. Holds less than 2^32 - 1 elements.
+ */
+template<class T, class Compare = std::less<T>, class Allocator = std::allocator<T>>
+class CompactSet : private ComparatorStorage<Compare> {
+  private:
+    using Index = uint32_t;
+
+    // Index used in place of null pointer.
+    constexpr static Index NIL = std::numeric_limits<Index>::max();
+
+    /* Element in AVL tree storing actual value and positions of three connected elements in the storage.
+     * Slot of an erased element holds no value and is marked with FREE_HEIGHT, so values are constructed only when
+     * inserted and do not need default constructor.
+     */
+    struct TNode {
+        Index left = NIL;
+        Index right = NIL;
+        Index parent = NIL;
+        int32_t height = FREE_HEIGHT;
+        union {
+            T val;
+        };
+
+        TNode() {}
+
+        template<class... Args>
+        explicit TNode(std::in_place_t, Args&&... args) : height(LEAF_HEIGHT), val(std::forward<Args>(args)...) {}
+
+        TNode(const TNode& other) {
+            *this = other;
+        }
+
+        TNode(TNode&& other) noexcept(std::is_nothrow_move_constructible<T>::value) {
+            *this = std::move(other);
+        }
+
+        TNode& operator=(const TNode& other) {
+            if (this != &other) {
+                clear();
+                left = other.left;
+                right = other.right;
+                parent = other.parent;
+                if (other.height != FREE_HEIGHT) {
+                    ::new (std::addressof(val)) T(other.val);
+                    height = other.height;
+                }
+            }
+            return *this;
+        }
+
+        TNode& operator=(TNode&& other) noexcept(std::is_nothrow_move_constructible<T>::value) {
+            if (this != &other) {
+                clear();
+                left = other.left;
+                right = other.right;
+                parent = other.parent;
+                if (other.height != FREE_HEIGHT) {
+                    ::new (std::addressof(val)) T(std::move(other.val));
+                    height = other.height;
+                }
+            }
+            return *this;
+        }
+
+        ~TNode() {
+            clear();
+        }
+
+        // Destroys the value, turning node into a free slot.
+        void clear() {
+            if (height != FREE_HEIGHT) {
+                val.~T();
+                height = FREE_HEIGHT;
+            }
+        }
+    };
+
+    using NodeAllocator = typename std::allocator_traits<Allocator>::template rebind_alloc<TNode>;
+
+  public:
+    using allocator_type = Allocator;
+
+    // Allows external access to the values stored in tree and finds next/prev element.
+    class iterator {
+      public:
+        iterator() = default;
+
+        iterator(const CompactSet* set, Index node) : set_(set), node_(node) {}
+
+        const T &operator*() {
+            if (node_ == NIL) {
+                assert(0);
+            }
+            return set_->nodes_[node_].val;
+        }
+
+        const T *operator->() {
+            return &(set_->nodes_[node_].val);
+        }
+
+        bool operator==(const iterator& b) const {
+            return (node_ == b.node_) && (set_ == b.set_);
+        }
+
+        bool operator!=(const iterator& b) const {
+            return (node_ != b.node_) || (set_ != b.set_);
+        }
+
+        // Finds next element in the tree, amortized time O(1), real time O(log size).
+        iterator& operator++() {
+            if (node_ == NIL) {
+                return *this;
+            }
+            const auto& nodes = set_->nodes_;
+            if (nodes[node_].right != NIL) {
+                node_ = nodes[node_].right;
+                while (nodes[node_].left != NIL) {
+                    node_ = nodes[node_].left;
+                }
+                return *this;
+            }
+
+            Index prev = node_;
+            node_ = nodes[node_].parent;
+            while (node_ != NIL && nodes[node_].right == prev) {
+                prev = node_;
+                node_ = nodes[node_].parent;
+            }
+            return *this;
+        }
+
+        // Finds previous element in the tree, amortized time O(1), real O(log size).
+        iterator& operator--() {
+            const auto& nodes = set_->nodes_;
+            if (node_ == NIL) {
+                node_ = set_->root_;
+                while (nodes[node_].right != NIL) {
+                    node_ = nodes[node_].right;
+                }
+                return *this;
+            }
+            if (nodes[node_].left != NIL) {
+                node_ = nodes[node_].left;
+                while (nodes[node_].right != NIL) {
+                    node_ = nodes[node_].right;
+                }
+                return *this;
+            }
+
+            Index prev = node_;
+            node_ = nodes[node_].parent;
+            while (node_ != NIL && nodes[node_].left == prev) {
+                prev = node_;
+                node_ = nodes[node_].parent;
+            }
+            if (node_ == NIL) {
+                assert(0);
+            }
+            return *this;
+        }
+
+        // Finds next element in the tree, amortized time O(1), real time O(log size).
+        const iterator operator++(int) {
+            iterator old_copy = *this;
+            this->operator++();
+            return old_copy;
+        }
+
+        // Finds previous element in the tree, amortized time O(1), real O(log size).
+        const iterator operator--(int) {
+            iterator old_copy = *this;
+            this->operator--();
+            return old_copy;
+        }
+
+      private:
+        friend class CompactSet;
+
+        const CompactSet *set_ = nullptr;
+        Index node_ = NIL;
+    };
+
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    CompactSet() = default;
+
+    explicit CompactSet(const Compare& comp, const Allocator& alloc = Allocator())
+        : ComparatorStorage<Compare>(comp), nodes_(NodeAllocator(alloc)) {}
+
+    explicit CompactSet(const Allocator& alloc) : nodes_(NodeAllocator(alloc)) {}
+
+    template<typename Iterator>
+    CompactSet(Iterator first, Iterator last, const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : CompactSet(comp, alloc) {
+        while (first != last) {
+            insert(*first);
+            ++first;
+        }
+    }
+
+    template<typename Iterator>
+    CompactSet(Iterator first, Iterator last, const Allocator& alloc) : CompactSet(first, last, Compare(), alloc) {}
+
+    CompactSet(std::initializer_list<T> elems, const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : CompactSet(comp, alloc) {
+        for (const T& elem : elems) {
+            insert(elem);
+        }
+    }
+
+    CompactSet(std::initializer_list<T> elems, const Allocator& alloc) : CompactSet(elems, Compare(), alloc) {}
+
+    CompactSet(const CompactSet& st) = default;
+
+    CompactSet& operator=(const CompactSet& st) = default;
+
+    // Move constructor takes over the storage of another set in constant time, leaving it empty.
+    CompactSet(CompactSet&& st) noexcept
+        : ComparatorStorage<Compare>(st.comparator()), nodes_(std::move(st.nodes_)), size_(st.size_), root_(st.root_),
+          free_list_(st.free_list_) {
+        st.forget_nodes();
+    }
+
+    /* Move assignment, constant time unless allocators differ and don't propagate, then the storage is moved
+     * element by element. Indices stay valid either way, the other set is left empty.
+     */
+    CompactSet& operator=(CompactSet&& st) noexcept(std::is_nothrow_move_assignable<std::vector<TNode, NodeAllocator>>::value) {
+        if (&st == this) {
+            return *this;
+        }
+        this->comparator() = st.comparator();
+        nodes_ = std::move(st.nodes_);
+        size_ = st.size_;
+        root_ = st.root_;
+        free_list_ = st.free_list_;
+        st.forget_nodes();
+        return *this;
+    }
+
+    allocator_type get_allocator() const {
+        return Allocator(nodes_.get_allocator());
+    }
+
+    key_compare key_comp() const {
+        return this->comparator();
+    }
+
+    value_compare value_comp() const {
+        return this->comparator();
+    }
+
+    size_t size() const {
+        return size_;
+    }
+
+#ifdef AVL_SET_STATS
+    const RebalanceStats& rebalance_stats() const {
+        return stats_;
+    }
+#endif
+
+    bool empty() const {
+        return (size_ == EMPTY_SET_SIZE);
+    }
+
+    // Preallocates storage for given amount of elements so that insertions do not relocate it.
+    void reserve(size_t capacity) {
+        nodes_.reserve(capacity);
+    }
+
+    // Inserts element in logarithmic time, simultaneously balances depth of the tree.
+    void insert(const T& elem) {
+        Index parent = NIL;
+        Index node = root_;
+        while (node != NIL) {
+            parent = node;
+            int32_t order = compare(elem, nodes_[node].val);
+            if (order < 0) {
+                node = nodes_[node].left;
+            } else if (order > 0) {
+                node = nodes_[node].right;
+            } else {
+                return;
+            }
+        }
+
+        node = create_node(elem);
+        ++size_;
+        if (parent == NIL) {
+            root_ = node;
+            return;
+        }
+        if (is_less(elem, nodes_[parent].val)) {
+            set_left(parent, node);
+        } else {
+            set_right(parent, node);
+        }
+        balance_path(parent);
+    }
+
+    /* Node with two children swaps values with the closest smaller node, which has no more than one child.
+     * The only child of deleted node is reassigned to its parent in place of the deleted. Logarithmic time.
+     */
+    void erase(const T& elem) {
+        Index node = find(elem).node_;
+        if (node == NIL) {
+            return;
+        }
+        if (nodes_[node].left != NIL && nodes_[node].right != NIL) {
+            Index prev = nodes_[node].left;
+            while (nodes_[prev].right != NIL) {
+                prev = nodes_[prev].right;
             }
-            if (original_node->right != nullptr) {
-                working_copy->set_right(new TNode(original_node->right->val));
-                copied_nodes.push(working_copy->right);
-                original_nodes.push(original_node->right);
+            std::swap(nodes_[node].val, nodes_[prev].val);
+            node = prev;
+        }
+
+        Index child = (nodes_[node].left != NIL ? nodes_[node].left : nodes_[node].right);
+        Index parent = nodes_[node].parent;
+        if (parent == NIL) {
+            root_ = child;
+            if (child != NIL) {
+                nodes_[child].parent = NIL;
             }
+        } else if (nodes_[parent].left == node) {
+            set_left(parent, child);
+        } else {
+            set_right(parent, child);
         }
+        release_node(node);
+        --size_;
+        balance_path(parent);
     }
 
-    // Deletes each node while traversing tree using stack for non-processed nodes, linear time.
-    void delete_all_nodes() {
-        if (root_ == nullptr) {
-            return;
+    iterator begin() const {
+        Index node = root_;
+        while (node != NIL && nodes_[node].left != NIL) {
+            node = nodes_[node].left;
         }
+        return iterator(this, node);
+    }
 
-        std::stack<TNode*> to_delete_nodes;
-        to_delete_nodes.push(root_);
-        while (!to_delete_nodes.empty()) {
-            TNode* cur = to_delete_nodes.top();
-            to_delete_nodes.pop();
-            if (cur->left != nullptr) {
-                to_delete_nodes.push(cur->left);
+    iterator end() const {
+        return iterator(this, NIL);
+    }
+
+    // Finds element with given value or returns end() if it doesn't exist. Logarithmic time.
+    iterator find(const T& elem) const {
+        Index node = root_;
+        while (node != NIL) {
+            int32_t order = compare(elem, nodes_[node].val);
+            if (order < 0) {
+                node = nodes_[node].left;
+            } else if (order > 0) {
+                node = nodes_[node].right;
+            } else {
+                return iterator(this, node);
             }
-            if (cur->right != nullptr) {
-                to_delete_nodes.push(cur->right);
+        }
+        return end();
+    }
+
+    // Finds the leftmost element with value greater or equal to given value. Logarithmic time.
+    iterator lower_bound(const T& elem) const {
+        Index node = root_;
+        Index last_successful = NIL;
+        while (node != NIL) {
+            if (is_less(nodes_[node].val, elem)) {
+                node = nodes_[node].right;
+            } else {
+                last_successful = node;
+                node = nodes_[node].left;
             }
-            delete cur;
         }
+        return iterator(this, last_successful);
+    }
 
-        root_ = nullptr;
-        begin_iter_ = iterator(nullptr, nullptr);
-        end_iter_ = iterator(nullptr, nullptr);
-        size_ = 0;
+  private:
+    constexpr static size_t EMPTY_SET_SIZE = 0;
+    constexpr static int32_t FREE_HEIGHT = 0;
+    constexpr static int32_t LEAF_HEIGHT = 1;
+
+    // Constants showing at which difference children's heights are considered imbalance.
+    constexpr static int32_t IMBALANCE_TO_LEFT = 2;
+    constexpr static int32_t IMBALANCE_TO_RIGHT = -2;
+
+    std::vector<TNode, NodeAllocator> nodes_;
+    size_t size_ = EMPTY_SET_SIZE;
+    Index root_ = NIL;
+    // Erased slots are chained through their left links.
+    Index free_list_ = NIL;
+#ifdef AVL_SET_STATS
+    RebalanceStats stats_;
+#endif
+
+    // Empties the set after its storage was moved to another one.
+    void forget_nodes() {
+        nodes_.clear();
+        size_ = EMPTY_SET_SIZE;
+        root_ = NIL;
+        free_list_ = NIL;
     }
 
-    /* Balances nodes' depth by swapping this node and its children so that children's heights differ for no more than 1.
-     * Before balancing we adjust children's heights so that rotating does not unbalance children.
+    // Constructs value in a recycled slot if there is one, otherwise appends a slot to the storage.
+    Index create_node(const T& value) {
+        if (free_list_ != NIL) {
+            Index node = free_list_;
+            TNode& slot = nodes_[node];
+            ::new (std::addressof(slot.val)) T(value);
+            free_list_ = slot.left;
+            slot.left = NIL;
+            slot.right = NIL;
+            slot.parent = NIL;
+            slot.height = LEAF_HEIGHT;
+            return node;
+        }
+        if (nodes_.size() == NIL) {
+            throw std::length_error("CompactSet size exceeds 32-bit index range");
+        }
+        nodes_.emplace_back(std::in_place, value);
+        return static_cast<Index>(nodes_.size() - 1);
+    }
+
+    // Destroys slot's value and puts the slot to the free list.
+    void release_node(Index node) {
+        nodes_[node].clear();
+        nodes_[node].left = free_list_;
+        free_list_ = node;
+    }
+
+    int32_t height(Index node) const {
+        return (node == NIL ? 0 : nodes_[node].height);
+    }
+
+    bool is_less(const T& a, const T& b) const {
+        return this->comparator()(a, b);
+    }
+
+    int32_t compare(const T& a, const T& b) const {
+        return compare_values(this->comparator(), a, b);
+    }
+
+    // Returns difference between left son's height and right son's height.
+    int32_t diff(Index node) const {
+        return height(nodes_[node].left) - height(nodes_[node].right);
+    }
+
+    // Calculates node's height based on children's height.
+    void update_height(Index node) {
+        nodes_[node].height = std::max(height(nodes_[node].left), height(nodes_[node].right)) + 1;
+    }
+
+    void count_visited_node() {
+#ifdef AVL_SET_STATS
+        ++stats_.visited_nodes;
+#endif
+    }
+
+    void count_rotation() {
+#ifdef AVL_SET_STATS
+        ++stats_.rotations;
+#endif
+    }
+
+    void set_left(Index node, Index new_left) {
+        nodes_[node].left = new_left;
+        if (new_left != NIL) {
+            nodes_[new_left].parent = node;
+        }
+    }
+
+    void set_right(Index node, Index new_right) {
+        nodes_[node].right = new_right;
+        if (new_right != NIL) {
+            nodes_[new_right].parent = node;
+        }
+    }
+
+    /* Rebalances nodes from given one up, relinking rotated subtrees to their parents.
+     * The walk stops at the first subtree whose height stays the same, since nodes above it are not affected.
      */
-    TNode* balance_node(TNode* old_root) {
-        if (old_root == nullptr) {
-            return old_root;
+    void balance_path(Index node) {
+        while (node != NIL) {
+            count_visited_node();
+            Index parent = nodes_[node].parent;
+            int32_t old_height = nodes_[node].height;
+            Index balanced = balance_node(node);
+            if (parent == NIL) {
+                root_ = balanced;
+                nodes_[balanced].parent = NIL;
+            } else if (nodes_[parent].left == node) {
+                set_left(parent, balanced);
+            } else {
+                set_right(parent, balanced);
+            }
+            if (nodes_[balanced].height == old_height) {
+                return;
+            }
+            node = parent;
         }
+    }
 
-        if (old_root->diff() == TNode::IMBALANCE_TO_RIGHT && old_root->right->diff() == TNode::TILTED_LEFT) {
-            old_root->set_right(increase_right_height(old_root->right));
-            return increase_left_height(old_root);
-        } else if (old_root->diff() == TNode::IMBALANCE_TO_RIGHT) {
+    // Updates node's height and rotates its subtree if children's heights differ by 2. Returns new subtree root.
+    Index balance_node(Index old_root) {
+        update_height(old_root);
+        if (diff(old_root) == IMBALANCE_TO_RIGHT) {
+            if (diff(nodes_[old_root].right) > 0) {
+                set_right(old_root, increase_right_height(nodes_[old_root].right));
+            }
             return increase_left_height(old_root);
-        } else if (old_root->diff() == TNode::IMBALANCE_TO_LEFT && old_root->left->diff() == TNode::TILTED_RIGHT) {
-            old_root->set_left(increase_left_height(old_root->left));
-            return increase_right_height(old_root);
-        } else if(old_root->diff() == TNode::IMBALANCE_TO_LEFT) {
+        }
+        if (diff(old_root) == IMBALANCE_TO_LEFT) {
+            if (diff(nodes_[old_root].left) < 0) {
+                set_left(old_root, increase_left_height(nodes_[old_root].left));
+            }
             return increase_right_height(old_root);
         }
         return old_root;
     }
 
-    // Makes right child new root in this subtree, thus shifting old root to be its left child and increasing left child's height.
-    TNode* increase_left_height(TNode* old_root) {
-        if (old_root->right == nullptr) {
-            return old_root;
-        }
-        TNode* root_parent = old_root->parent;
-        TNode* new_root = old_root->right;
+    // Makes right child new root in this subtree, thus shifting old root to be its left child.
+    Index increase_left_height(Index old_root) {
+        count_rotation();
+        Index new_root = nodes_[old_root].right;
+        nodes_[new_root].parent = nodes_[old_root].parent;
+        set_right(old_root, nodes_[new_root].left);
+        set_left(new_root, old_root);
+        update_height(old_root);
+        update_height(new_root);
+        return new_root;
+    }
 
-        old_root->set_right(new_root->left);
-        new_root->set_left(old_root);
-        new_root->parent = root_parent;
+    // Makes left child new root in this subtree, thus shifting old root to be its right child.
+    Index increase_right_height(Index old_root) {
+        count_rotation();
+        Index new_root = nodes_[old_root].left;
+        nodes_[new_root].parent = nodes_[old_root].parent;
+        set_left(old_root, nodes_[new_root].right);
+        set_right(new_root, old_root);
+        update_height(old_root);
+        update_height(new_root);
         return new_root;
     }
+};
 
-    // Makes left child new root in this subtree, thus shifting old root to be its right child and increasing right child's height.
-    TNode* increase_right_height(TNode* old_root) {
-        if (old_root->left == nullptr) {
-            return old_root;
+/* Set keeping up to N elements in a sorted array inside the object itself and switching to Set when it grows larger.
+ * Tiny sets then need no heap allocation and search a few adjacent values instead of following links.
+ * Once promoted, elements stay in the tree until the set becomes empty. Inserting or erasing in the array moves
+ * later elements, so modifications invalidate iterators while the set is small.
+ */
+template<class T, size_t N = 16, class Compare = std::less<T>, class Allocator = std::allocator<T>>
+class SmallSet {
+  private:
+    using Tree = Set<T, Compare, Allocator>;
+
+  public:
+    using allocator_type = Allocator;
+
+    // Points either into the inline array or into the tree, depending on where the elements are.
+    class iterator {
+      public:
+        iterator() = default;
+
+        const T &operator*() {
+            return (inline_pos_ != nullptr ? *inline_pos_ : *tree_pos_);
         }
-        TNode* root_parent = old_root->parent;
-        TNode* new_root = old_root->left;
 
-        old_root->set_left(new_root->right);
-        new_root->set_right(old_root);
-        new_root->parent = root_parent;
-        return new_root;
+        const T *operator->() {
+            return &(this->operator*());
+        }
+
+        bool operator==(const iterator& b) const {
+            return (inline_pos_ == b.inline_pos_) && (tree_pos_ == b.tree_pos_);
+        }
+
+        bool operator!=(const iterator& b) const {
+            return !(*this == b);
+        }
+
+        iterator& operator++() {
+            if (inline_pos_ != nullptr) {
+                ++inline_pos_;
+            } else {
+                ++tree_pos_;
+            }
+            return *this;
+        }
+
+        iterator& operator--() {
+            if (inline_pos_ != nullptr) {
+                --inline_pos_;
+            } else {
+                --tree_pos_;
+            }
+            return *this;
+        }
+
+        const iterator operator++(int) {
+            iterator old_copy = *this;
+            this->operator++();
+            return old_copy;
+        }
+
+        const iterator operator--(int) {
+            iterator old_copy = *this;
+            this->operator--();
+            return old_copy;
+        }
+
+      private:
+        friend class SmallSet;
+
+        const T *inline_pos_ = nullptr;
+        typename Tree::iterator tree_pos_;
+
+        explicit iterator(const T* inline_pos) : inline_pos_(inline_pos) {}
+
+        explicit iterator(typename Tree::iterator tree_pos) : tree_pos_(tree_pos) {}
+    };
+
+    using key_compare = Compare;
+    using value_compare = Compare;
+
+    SmallSet() = default;
+
+    // Comparator is kept by the tree, which exists in both modes.
+    explicit SmallSet(const Compare& comp, const Allocator& alloc = Allocator()) : tree_(comp, alloc) {}
+
+    explicit SmallSet(const Allocator& alloc) : tree_(alloc) {}
+
+    template<typename Iterator>
+    SmallSet(Iterator first, Iterator last, const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : SmallSet(comp, alloc) {
+        while (first != last) {
+            insert(*first);
+            ++first;
+        }
     }
 
-    // Finds iterators for the first element and the element after the last.
-    void set_boundary_iters() {
-        TNode* node = root_;
-        while (node != nullptr && node->left != nullptr) {
-            node = node->left;
+    template<typename Iterator>
+    SmallSet(Iterator first, Iterator last, const Allocator& alloc) : SmallSet(first, last, Compare(), alloc) {}
+
+    SmallSet(std::initializer_list<T> elems, const Compare& comp = Compare(), const Allocator& alloc = Allocator())
+        : SmallSet(comp, alloc) {
+        for (const T& elem : elems) {
+            insert(elem);
+        }
+    }
+
+    SmallSet(std::initializer_list<T> elems, const Allocator& alloc) : SmallSet(elems, Compare(), alloc) {}
+
+    SmallSet(const SmallSet& st) : tree_(st.tree_) {
+        for (; inline_size_ < st.inline_size_; ++inline_size_) {
+            ::new (static_cast<void*>(inline_data() + inline_size_)) T(st.inline_data()[inline_size_]);
+        }
+    }
+
+    SmallSet(SmallSet&& st) noexcept(std::is_nothrow_move_constructible<T>::value) : tree_(std::move(st.tree_)) {
+        for (; inline_size_ < st.inline_size_; ++inline_size_) {
+            ::new (static_cast<void*>(inline_data() + inline_size_)) T(std::move(st.inline_data()[inline_size_]));
+        }
+        st.clear_inline();
+    }
+
+    SmallSet& operator=(const SmallSet& st) {
+        if (&st != this) {
+            SmallSet copy(st);
+            *this = std::move(copy);
+        }
+        return *this;
+    }
+
+    SmallSet& operator=(SmallSet&& st) noexcept(std::is_nothrow_move_constructible<T>::value) {
+        if (&st != this) {
+            clear_inline();
+            tree_ = std::move(st.tree_);
+            for (; inline_size_ < st.inline_size_; ++inline_size_) {
+                ::new (static_cast<void*>(inline_data() + inline_size_)) T(std::move(st.inline_data()[inline_size_]));
+            }
+            st.clear_inline();
+        }
+        return *this;
+    }
+
+    ~SmallSet() {
+        clear_inline();
+    }
+
+    allocator_type get_allocator() const {
+        return tree_.get_allocator();
+    }
+
+    key_compare key_comp() const {
+        return tree_.key_comp();
+    }
+
+    value_compare value_comp() const {
+        return tree_.key_comp();
+    }
+
+    size_t size() const {
+        return (is_inline() ? inline_size_ : tree_.size());
+    }
+
+    bool empty() const {
+        return (size() == 0);
+    }
+
+    // Linear time while elements are inline, logarithmic afterwards.
+    void insert(const T& elem) {
+        insert_value(elem);
+    }
+
+    void insert(T&& elem) {
+        insert_value(std::move(elem));
+    }
+
+    // Linear time while elements are inline, logarithmic afterwards.
+    void erase(const T& elem) {
+        if (!is_inline()) {
+            tree_.erase(elem);
+            return;
+        }
+        T* pos = inline_lower_bound(elem);
+        if (pos == inline_end() || is_less(elem, *pos)) {
+            return;
+        }
+        std::move(pos + 1, inline_end(), pos);
+        --inline_size_;
+        inline_end()->~T();
+    }
+
+    iterator begin() const {
+        return (is_inline() ? iterator(inline_data()) : iterator(tree_.begin()));
+    }
+
+    iterator end() const {
+        return (is_inline() ? iterator(inline_end()) : iterator(tree_.end()));
+    }
+
+    // Finds element with given value or returns end() if it doesn't exist. Logarithmic time.
+    iterator find(const T& elem) const {
+        if (!is_inline()) {
+            return iterator(tree_.find(elem));
+        }
+        const T* pos = inline_lower_bound(elem);
+        if (pos == inline_end() || is_less(elem, *pos)) {
+            return end();
+        }
+        return iterator(pos);
+    }
+
+    // Finds the leftmost element with value greater or equal to given value. Logarithmic time.
+    iterator lower_bound(const T& elem) const {
+        if (!is_inline()) {
+            return iterator(tree_.lower_bound(elem));
+        }
+        return iterator(inline_lower_bound(elem));
+    }
+
+  private:
+    // Elements live in the tree whenever it is not empty, otherwise in the inline array.
+    Tree tree_;
+    size_t inline_size_ = 0;
+    alignas(T) unsigned char inline_storage_[N * sizeof(T)];
+
+    bool is_inline() const {
+        return tree_.empty();
+    }
+
+    bool is_less(const T& a, const T& b) const {
+        return tree_.comparator()(a, b);
+    }
+
+    T* inline_data() {
+        return std::launder(reinterpret_cast<T*>(inline_storage_));
+    }
+
+    const T* inline_data() const {
+        return std::launder(reinterpret_cast<const T*>(inline_storage_));
+    }
+
+    T* inline_end() {
+        return inline_data() + inline_size_;
+    }
+
+    const T* inline_end() const {
+        return inline_data() + inline_size_;
+    }
+
+    T* inline_lower_bound(const T& elem) {
+        return std::lower_bound(inline_data(), inline_end(), elem,
+                                [this](const T& a, const T& b) { return is_less(a, b); });
+    }
+
+    const T* inline_lower_bound(const T& elem) const {
+        return std::lower_bound(inline_data(), inline_end(), elem,
+                                [this](const T& a, const T& b) { return is_less(a, b); });
+    }
+
+    void clear_inline() {
+        for (; inline_size_ > 0; --inline_size_) {
+            inline_data()[inline_size_ - 1].~T();
+        }
+    }
+
+    template<class Value>
+    void insert_value(Value&& elem) {
+        if (!is_inline()) {
+            tree_.insert(std::forward<Value>(elem));
+            return;
+        }
+        T* pos = inline_lower_bound(elem);
+        if (pos != inline_end() && !is_less(elem, *pos)) {
+            return;
+        }
+        if (inline_size_ == N) {
+            promote(std::forward<Value>(elem));
+            return;
+        }
+        if (pos == inline_end()) {
+            ::new (static_cast<void*>(pos)) T(std::forward<Value>(elem));
+        } else {
+            // The last element moves to uninitialized storage, the others shift by assignment.
+            T value(std::forward<Value>(elem));
+            ::new (static_cast<void*>(inline_end())) T(std::move(inline_end()[-1]));
+            std::move_backward(pos, inline_end() - 1, inline_end());
+            *pos = std::move(value);
+        }
+        ++inline_size_;
+    }
+
+    /* Puts all inline elements and the new one into the tree. The sorted inline array is built into the tree in linear
+     * time and released only once the tree is complete. Elements are copied, so the set is intact if an allocation
+     * throws. Elements which can't be copied are moved, and the set is left empty if an allocation throws.
+     */
+    template<class Value>
+    void promote(Value&& elem) {
+        try {
+            Tree tree = build_from_inline();
+            tree.insert(std::forward<Value>(elem));
+            clear_inline();
+            tree_ = std::move(tree);
+        } catch (...) {
+            if constexpr (!std::is_copy_constructible<T>::value) {
+                clear_inline();
+            }
+            throw;
+        }
+    }
+
+    Tree build_from_inline() {
+        if constexpr (std::is_copy_constructible<T>::value) {
+            return Tree(sorted_unique, inline_data(), inline_end(), tree_.key_comp(), tree_.get_allocator());
+        } else {
+            return Tree(sorted_unique, std::make_move_iterator(inline_data()), std::make_move_iterator(inline_end()),
+                        tree_.key_comp(), tree_.get_allocator());
         }
-        begin_iter_ = iterator(node, root_);
-        end_iter_ = iterator(nullptr, root_);
     }
 };
 
+namespace pmr {
+    // Set allocating its nodes from a std::pmr::memory_resource.
+    template<class T, class Compare = std::less<T>, bool ParentLinks = true>
+    using Set = ::Set<T, Compare, std::pmr::polymorphic_allocator<T>, ParentLinks>;
+}
+
 int main() {
     return 0;
 }